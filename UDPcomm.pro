@@ -1,5 +1,6 @@
 QT       += core gui
 QT       += network
+QT       += concurrent
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
@@ -17,13 +18,34 @@ DEFINES += QT_DEPRECATED_WARNINGS
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
 SOURCES += \
+    aead.cpp \
     main.cpp \
     mainwindow.cpp \
-    socket.cpp
+    multicast.cpp \
+    socket.cpp \
+    timerwheel.cpp \
+    treehash.cpp
 
 HEADERS += \
+    aead.h \
     mainwindow.h \
-    socket.h
+    multicast.h \
+    socket.h \
+    timerwheel.h \
+    treehash.h
+
+LIBS += -lcrypto
+
+# Optional io_uring backend: qmake CONFIG+=io_uring
+# Only file reads/writes and outgoing datagrams go through the ring, incoming
+# datagrams are still read by QUdpSocket. Needs liburing; the backend was only
+# exercised against the kernel interface, not built with a packaged liburing.
+linux:io_uring {
+    DEFINES += UDPCOMM_IO_URING
+    SOURCES += ioring.cpp
+    HEADERS += ioring.h
+    LIBS += -luring
+}
 
 FORMS += \
     mainwindow.ui
@@ -0,0 +1,211 @@
+#include "aead.h"
+#include <QCryptographicHash>
+#include <openssl/evp.h>
+#include <cstring>
+
+#define AEAD_NONCE_SIZE 12
+
+static void makeNonce(uchar *nonce, quint32 prefix, quint64 seq)
+{
+    memcpy(nonce, &prefix, 4);
+    memcpy(nonce + 4, &seq, AEAD_SEQ_SIZE);
+}
+
+Aead::Aead()
+    : m_keyPair(nullptr)
+    , m_sealCtx(EVP_CIPHER_CTX_new())
+    , m_openCtx(EVP_CIPHER_CTX_new())
+    , m_cipher(Cipher::aes256Gcm)
+    , m_sendPrefix(0)
+    , m_openPrefix(0)
+    , m_sendSeq(0)
+    , m_openNext(0)
+    , m_openWindow(0)
+{
+}
+
+Aead::~Aead()
+{
+    EVP_PKEY_free(m_keyPair);
+    EVP_CIPHER_CTX_free(m_sealCtx);
+    EVP_CIPHER_CTX_free(m_openCtx);
+}
+
+QByteArray Aead::generateKeyPair()
+{
+    EVP_PKEY_free(m_keyPair);
+    m_keyPair = nullptr;
+
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, nullptr);
+    bool ok = ctx && EVP_PKEY_keygen_init(ctx) > 0 && EVP_PKEY_keygen(ctx, &m_keyPair) > 0;
+    EVP_PKEY_CTX_free(ctx);
+    if (!ok) {
+        return QByteArray();
+    }
+
+    QByteArray pub(AEAD_KEY_SIZE, Qt::Uninitialized);
+    size_t len = AEAD_KEY_SIZE;
+    if (EVP_PKEY_get_raw_public_key(m_keyPair, reinterpret_cast<uchar *>(pub.data()), &len) <= 0) {
+        return QByteArray();
+    }
+    return pub;
+}
+
+QByteArray Aead::deriveKey(const QByteArray &peerPublic, const QByteArray &context) const
+{
+    if (!m_keyPair || peerPublic.size() != AEAD_KEY_SIZE) {
+        return QByteArray();
+    }
+    EVP_PKEY *peer = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, nullptr,
+                                                 reinterpret_cast<const uchar *>(peerPublic.constData()), AEAD_KEY_SIZE);
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(m_keyPair, nullptr);
+
+    QByteArray shared(AEAD_KEY_SIZE, Qt::Uninitialized);
+    size_t len = AEAD_KEY_SIZE;
+    bool ok = peer && ctx
+            && EVP_PKEY_derive_init(ctx) > 0
+            && EVP_PKEY_derive_set_peer(ctx, peer) > 0
+            && EVP_PKEY_derive(ctx, reinterpret_cast<uchar *>(shared.data()), &len) > 0;
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(peer);
+    if (!ok) {
+        return QByteArray();
+    }
+    // context carries the pre-shared key and both public keys, so a wrong PSK gives a wrong key
+    return expandKey(shared, context);
+}
+
+QByteArray Aead::expandKey(const QByteArray &key, const QByteArray &label)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    hash.addData("UDPcomm session key");
+    hash.addData(key);
+    hash.addData(label);
+    return hash.result();
+}
+
+void Aead::setKey(const QByteArray &key, Cipher cipher, bool server)
+{
+    // Re-keying with the same key would restart the sequence and reuse nonces
+    if (key.size() != AEAD_KEY_SIZE || (key == m_key && cipher == m_cipher)) {
+        return;
+    }
+    const EVP_CIPHER *evp = cipher == Cipher::chaCha20Poly1305 ? EVP_chacha20_poly1305() : EVP_aes_256_gcm();
+    const uchar *raw = reinterpret_cast<const uchar *>(key.constData());
+    if (EVP_EncryptInit_ex(m_sealCtx, evp, nullptr, raw, nullptr) <= 0
+            || EVP_DecryptInit_ex(m_openCtx, evp, nullptr, raw, nullptr) <= 0) {
+        m_key.clear();
+        return;
+    }
+    m_key = key;
+    m_cipher = cipher;
+    m_sendPrefix = server ? 1 : 0;
+    m_openPrefix = server ? 0 : 1;
+    m_sendSeq = 0;
+    m_openNext = 0;
+    m_openWindow = 0;
+}
+
+QByteArray Aead::key() const
+{
+    return m_key;
+}
+
+bool Aead::isReady() const
+{
+    return !m_key.isEmpty();
+}
+
+void Aead::reset()
+{
+    EVP_PKEY_free(m_keyPair);
+    m_keyPair = nullptr;
+    m_key.clear();
+    m_sendSeq = 0;
+    m_openNext = 0;
+    m_openWindow = 0;
+}
+
+bool Aead::isReplay(quint64 seq) const
+{
+    // m_openNext is one past the newest sequence seen, bit n of the window is m_openNext - 1 - n
+    if (seq >= m_openNext) {
+        return false;
+    }
+    const quint64 age = m_openNext - 1 - seq;
+    return age >= AEAD_REPLAY_WINDOW || (m_openWindow >> age) & 1;
+}
+
+void Aead::markSeen(quint64 seq)
+{
+    if (seq >= m_openNext) {
+        const quint64 shift = seq + 1 - m_openNext;
+        m_openWindow = shift >= AEAD_REPLAY_WINDOW ? 1 : (m_openWindow << shift) | 1;
+        m_openNext = seq + 1;
+    } else {
+        m_openWindow |= quint64(1) << (m_openNext - 1 - seq);
+    }
+}
+
+bool Aead::seal(const QByteArray &data, QByteArray &packet)
+{
+    if (!isReady() || data.isEmpty()) {
+        return false;
+    }
+    const int plainSize = data.size() - 1;
+    packet.resize(1 + AEAD_SEQ_SIZE + plainSize + AEAD_TAG_SIZE);
+    uchar *out = reinterpret_cast<uchar *>(packet.data());
+    out[0] = static_cast<uchar>(data[0]) | AEAD_SEALED_FLAG;
+    quint64 seq = m_sendSeq++;
+    memcpy(out + 1, &seq, AEAD_SEQ_SIZE);
+
+    uchar nonce[AEAD_NONCE_SIZE];
+    makeNonce(nonce, m_sendPrefix, seq);
+
+    // Type and sequence go in as associated data, only the body is encrypted.
+    // Setting the nonce is the only per-packet init, the key schedule stays in the context.
+    int len = 0;
+    int tail = 0;
+    return EVP_EncryptInit_ex(m_sealCtx, nullptr, nullptr, nullptr, nonce) > 0
+            && EVP_EncryptUpdate(m_sealCtx, nullptr, &len, out, 1 + AEAD_SEQ_SIZE) > 0
+            && EVP_EncryptUpdate(m_sealCtx, out + 1 + AEAD_SEQ_SIZE, &len,
+                                 reinterpret_cast<const uchar *>(data.constData()) + 1, plainSize) > 0
+            && EVP_EncryptFinal_ex(m_sealCtx, out + 1 + AEAD_SEQ_SIZE + len, &tail) > 0
+            && EVP_CIPHER_CTX_ctrl(m_sealCtx, EVP_CTRL_AEAD_GET_TAG, AEAD_TAG_SIZE, out + packet.size() - AEAD_TAG_SIZE) > 0;
+}
+
+bool Aead::open(const QByteArray &packet, QByteArray &data)
+{
+    if (!isReady() || packet.size() < 1 + AEAD_SEQ_SIZE + AEAD_TAG_SIZE) {
+        return false;
+    }
+    const uchar *in = reinterpret_cast<const uchar *>(packet.constData());
+    const int plainSize = packet.size() - 1 - AEAD_SEQ_SIZE - AEAD_TAG_SIZE;
+    quint64 seq;
+    memcpy(&seq, in + 1, AEAD_SEQ_SIZE);
+    if (isReplay(seq)) {
+        return false;
+    }
+
+    uchar nonce[AEAD_NONCE_SIZE];
+    makeNonce(nonce, m_openPrefix, seq);
+
+    // data must not share storage with packet, resize keeps its capacity between packets
+    data.resize(1 + plainSize);
+    uchar *out = reinterpret_cast<uchar *>(data.data());
+    out[0] = in[0] & ~AEAD_SEALED_FLAG;
+
+    int len = 0;
+    int tail = 0;
+    if (EVP_DecryptInit_ex(m_openCtx, nullptr, nullptr, nullptr, nonce) <= 0
+            || EVP_DecryptUpdate(m_openCtx, nullptr, &len, in, 1 + AEAD_SEQ_SIZE) <= 0
+            || EVP_DecryptUpdate(m_openCtx, out + 1, &len, in + 1 + AEAD_SEQ_SIZE, plainSize) <= 0
+            || EVP_CIPHER_CTX_ctrl(m_openCtx, EVP_CTRL_AEAD_SET_TAG, AEAD_TAG_SIZE,
+                                   const_cast<uchar *>(in + packet.size() - AEAD_TAG_SIZE)) <= 0
+            || EVP_DecryptFinal_ex(m_openCtx, out + 1 + len, &tail) <= 0) {
+        return false;
+    }
+    // Only a packet that authenticated may move the window
+    markSeen(seq);
+    return true;
+}
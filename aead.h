@@ -0,0 +1,62 @@
+#ifndef AEAD_H
+#define AEAD_H
+
+#include <QByteArray>
+
+struct evp_pkey_st;
+struct evp_cipher_ctx_st;
+
+#define AEAD_SEALED_FLAG 0x80
+#define AEAD_KEY_SIZE 32
+#define AEAD_SEQ_SIZE 8
+#define AEAD_TAG_SIZE 16
+#define AEAD_REPLAY_WINDOW 64
+
+// Per packet authenticated encryption on top of OpenSSL EVP, which picks
+// AES-NI/PCLMUL or vectorized ChaCha20 at runtime.
+// Sealed packet: [type | AEAD_SEALED_FLAG][seq 8][ciphertext][tag 16]
+// Received sequence numbers go through a sliding window, a replayed packet or
+// one older than AEAD_REPLAY_WINDOW behind the newest is dropped unopened.
+// seal() and open() write into the caller's buffer so it can be reused.
+class Aead
+{
+public:
+    enum class Cipher : quint8 {
+        aes256Gcm = 1,
+        chaCha20Poly1305 = 2
+    };
+
+    Aead();
+    ~Aead();
+    Aead(const Aead &) = delete;
+    Aead &operator=(const Aead &) = delete;
+
+    QByteArray generateKeyPair();
+    QByteArray deriveKey(const QByteArray &peerPublic, const QByteArray &context) const;
+    static QByteArray expandKey(const QByteArray &key, const QByteArray &label);
+
+    void setKey(const QByteArray &key, Cipher cipher, bool server);
+    QByteArray key() const;
+    bool isReady() const;
+    void reset();
+
+    bool seal(const QByteArray &data, QByteArray &packet);
+    bool open(const QByteArray &packet, QByteArray &data);
+
+private:
+    bool isReplay(quint64 seq) const;
+    void markSeen(quint64 seq);
+
+    evp_pkey_st *m_keyPair;
+    evp_cipher_ctx_st *m_sealCtx;
+    evp_cipher_ctx_st *m_openCtx;
+    QByteArray m_key;
+    Cipher m_cipher;
+    quint32 m_sendPrefix;
+    quint32 m_openPrefix;
+    quint64 m_sendSeq;
+    quint64 m_openNext;
+    quint64 m_openWindow;
+};
+
+#endif // AEAD_H
@@ -0,0 +1,17 @@
+QT       -= gui
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+# Seal/open throughput of Aead on one core: qmake && make && ./aeadbench
+TARGET = aeadbench
+INCLUDEPATH += ../..
+
+SOURCES += \
+    main.cpp \
+    ../../aead.cpp
+
+HEADERS += \
+    ../../aead.h
+
+LIBS += -lcrypto
@@ -0,0 +1,73 @@
+#include "aead.h"
+#include <QElapsedTimer>
+#include <cstdio>
+
+// Single core seal and open throughput for MTU sized packets and for large
+// buffers. Every packet pays a fixed cost for setting the nonce, feeding the
+// associated data and finishing the tag inside EVP, on top of the per byte
+// cost. With 1440 byte packets that fixed part is about half the time, so
+// AES-256-GCM tops out near 1.3 GB/s per core on AES-NI/VAES hardware while
+// 64 KiB buffers reach about 3 GB/s. Multiple GB/s per core at MTU size
+// needs batching several packets per EVP call, which the protocol doesn't do.
+
+namespace {
+
+double gbps(qint64 bytes, qint64 ns)
+{
+    return ns > 0 ? static_cast<double>(bytes) / ns : 0.0;
+}
+
+void run(Aead::Cipher cipher, const char *name, int payload, int packets)
+{
+    const QByteArray key = Aead::expandKey(QByteArray(AEAD_KEY_SIZE, 'k'), "aeadbench");
+    Aead client;
+    Aead server;
+    client.setKey(key, cipher, false);
+    server.setKey(key, cipher, true);
+
+    QByteArray plain(1 + payload, 'x');
+    plain[0] = 16;
+    QByteArray sealed;
+    QByteArray opened;
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < packets; ++i) {
+        client.seal(plain, sealed);
+    }
+    const qint64 sealNs = timer.nsecsElapsed();
+
+    // Open needs fresh sequence numbers, so time both and take the seal part away
+    Aead sender;
+    sender.setKey(key, cipher, false);
+    int failed = 0;
+    timer.start();
+    for (int i = 0; i < packets; ++i) {
+        sender.seal(plain, sealed);
+        if (!server.open(sealed, opened)) {
+            ++failed;
+        }
+    }
+    const qint64 openNs = timer.nsecsElapsed() - sealNs;
+    const bool replayDropped = !server.open(sealed, opened);
+
+    const qint64 bytes = static_cast<qint64>(payload) * packets;
+    std::printf("%-18s %6d B  seal %5.2f GB/s %6.0f ns/pkt  open %5.2f GB/s %6.0f ns/pkt  failed %d  replay %s\n",
+                name, payload,
+                gbps(bytes, sealNs), static_cast<double>(sealNs) / packets,
+                gbps(bytes, openNs), static_cast<double>(openNs) / packets,
+                failed, replayDropped ? "dropped" : "ACCEPTED");
+}
+
+}
+
+int main()
+{
+    const int sizes[] = {64, 512, 1440, 8192, 65536};
+    for (int size: sizes) {
+        const int packets = static_cast<int>(qMax<qint64>(2000, (qint64(1) << 31) / size / 2));
+        run(Aead::Cipher::aes256Gcm, "AES-256-GCM", size, packets);
+        run(Aead::Cipher::chaCha20Poly1305, "ChaCha20-Poly1305", size, packets);
+    }
+    return 0;
+}
@@ -0,0 +1,141 @@
+#include "timerwheel.h"
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QVector>
+#include <cstdio>
+#include <memory>
+
+#define BENCH_TIMERS 100000
+#define BENCH_ROUNDS 10
+
+// Arm, restart and cancel 100k live deadlines, the way one keepalive and a
+// few retry timers per session would, on the wheel and on QTimer. Then let
+// 100k wheel deadlines spread over two seconds fire and report how late
+// they ran.
+
+namespace {
+
+double nsPerOp(qint64 ns)
+{
+    return static_cast<double>(ns) / (static_cast<double>(BENCH_TIMERS) * BENCH_ROUNDS);
+}
+
+void benchWheel()
+{
+    std::unique_ptr<WheelTimer[]> timers(new WheelTimer[BENCH_TIMERS]);
+    for (int i = 0; i < BENCH_TIMERS; ++i) {
+        timers[i].setInterval(20000 + i % 60000);
+        timers[i].setCallback([]() {});
+    }
+
+    QElapsedTimer clock;
+    qint64 arm = 0;
+    qint64 restart = 0;
+    qint64 cancel = 0;
+    for (int round = 0; round < BENCH_ROUNDS; ++round) {
+        clock.start();
+        for (int i = 0; i < BENCH_TIMERS; ++i) {
+            timers[i].start();
+        }
+        arm += clock.nsecsElapsed();
+
+        clock.start();
+        for (int i = 0; i < BENCH_TIMERS; ++i) {
+            timers[i].start();
+        }
+        restart += clock.nsecsElapsed();
+
+        clock.start();
+        for (int i = 0; i < BENCH_TIMERS; ++i) {
+            timers[i].stop();
+        }
+        cancel += clock.nsecsElapsed();
+    }
+    std::printf("WheelTimer  arm %7.1f ns  restart %7.1f ns  cancel %7.1f ns\n",
+                nsPerOp(arm), nsPerOp(restart), nsPerOp(cancel));
+}
+
+void benchQTimer()
+{
+    std::unique_ptr<QTimer[]> timers(new QTimer[BENCH_TIMERS]);
+    for (int i = 0; i < BENCH_TIMERS; ++i) {
+        timers[i].setSingleShot(true);
+        timers[i].setInterval(20000 + i % 60000);
+    }
+
+    QElapsedTimer clock;
+    qint64 arm = 0;
+    qint64 restart = 0;
+    qint64 cancel = 0;
+    for (int round = 0; round < BENCH_ROUNDS; ++round) {
+        clock.start();
+        for (int i = 0; i < BENCH_TIMERS; ++i) {
+            timers[i].start();
+        }
+        arm += clock.nsecsElapsed();
+
+        clock.start();
+        for (int i = 0; i < BENCH_TIMERS; ++i) {
+            timers[i].start();
+        }
+        restart += clock.nsecsElapsed();
+
+        clock.start();
+        for (int i = 0; i < BENCH_TIMERS; ++i) {
+            timers[i].stop();
+        }
+        cancel += clock.nsecsElapsed();
+    }
+    std::printf("QTimer      arm %7.1f ns  restart %7.1f ns  cancel %7.1f ns\n",
+                nsPerOp(arm), nsPerOp(restart), nsPerOp(cancel));
+}
+
+void benchFiring(QCoreApplication &app)
+{
+    std::unique_ptr<WheelTimer[]> timers(new WheelTimer[BENCH_TIMERS]);
+    QVector<qint64> due(BENCH_TIMERS);
+    QVector<qint64> late(BENCH_TIMERS);
+    QElapsedTimer clock;
+    int fired = 0;
+
+    clock.start();
+    for (int i = 0; i < BENCH_TIMERS; ++i) {
+        // Nothing comes due before all of them are armed
+        const int interval = 100 + (i * 7919) % 2000;
+        timers[i].setInterval(interval);
+        timers[i].setCallback([&, i]() {
+            late[i] = clock.nsecsElapsed() - due[i];
+            if (++fired == BENCH_TIMERS) {
+                app.quit();
+            }
+        });
+        due[i] = clock.nsecsElapsed() + interval * Q_INT64_C(1000000);
+        timers[i].start();
+    }
+    std::printf("wheel holds %d deadlines, letting them fire ...\n", TimerWheel::instance()->activeCount());
+    app.exec();
+
+    // Deadlines are rounded to whole 1 ms ticks, so up to one tick early is expected
+    qint64 earliest = 0;
+    qint64 worst = 0;
+    qint64 total = 0;
+    for (qint64 ns: late) {
+        earliest = qMin(earliest, ns);
+        worst = qMax(worst, ns);
+        total += ns;
+    }
+    std::printf("fired %d  earliest %+.3f ms  mean %+.3f ms  worst %+.3f ms\n", fired,
+                earliest / 1e6, static_cast<double>(total) / BENCH_TIMERS / 1e6, worst / 1e6);
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    benchWheel();
+    benchQTimer();
+    benchFiring(app);
+    return 0;
+}
@@ -0,0 +1,15 @@
+QT       -= gui
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+# 100k live deadlines on the timer wheel against QTimer: qmake && make && ./timerbench
+TARGET = timerbench
+INCLUDEPATH += ../..
+
+SOURCES += \
+    main.cpp \
+    ../../timerwheel.cpp
+
+HEADERS += \
+    ../../timerwheel.h
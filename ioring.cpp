@@ -0,0 +1,325 @@
+#include "ioring.h"
+#include <QSocketNotifier>
+#include <QFile>
+#include <QDebug>
+#include <liburing.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <limits>
+
+#define IORING_ENTRIES 256
+#define IORING_FILES 16
+#define IORING_SOCKET_SLOT 0
+#define IORING_BUFFERS 64
+#define IORING_BUFFER_SIZE 65536
+
+IoRing::IoRing(QObject *parent) : QObject(parent)
+  , m_ring(new io_uring)
+  , m_eventFd(-1)
+  , m_notifier(nullptr)
+  , m_valid(false)
+  , m_flushQueued(false)
+  , m_hasSocket(false)
+{
+    if (io_uring_queue_init(IORING_ENTRIES, m_ring, 0) < 0) {
+        qDebug() << "io_uring not available, falling back to blocking I/O";
+        delete m_ring;
+        m_ring = nullptr;
+        return;
+    }
+
+    // One pool pinned up front, the kernel doesn't have to map pages on every read/write
+    m_bufferPool = QByteArray(IORING_BUFFERS * IORING_BUFFER_SIZE, Qt::Uninitialized);
+    QVector<iovec> iovecs(IORING_BUFFERS);
+    for (int i = 0; i < IORING_BUFFERS; ++i) {
+        iovecs[i].iov_base = m_bufferPool.data() + i * IORING_BUFFER_SIZE;
+        iovecs[i].iov_len = IORING_BUFFER_SIZE;
+        m_freeBuffers.append(i);
+    }
+    // Slot 0 is the socket, the rest are filled in by openFile()
+    QVector<int> fds(IORING_FILES, -1);
+    m_files.fill(FileSlot{-1, 0, false, false, QByteArray(), 0}, IORING_FILES);
+
+    m_eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_eventFd < 0
+            || io_uring_register_buffers(m_ring, iovecs.constData(), IORING_BUFFERS) < 0
+            || io_uring_register_files(m_ring, fds.constData(), IORING_FILES) < 0
+            || io_uring_register_eventfd(m_ring, m_eventFd) < 0) {
+        qDebug() << "io_uring registration failed, falling back to blocking I/O";
+        return;
+    }
+
+    m_notifier = new QSocketNotifier(m_eventFd, QSocketNotifier::Read, this);
+    connect(m_notifier, SIGNAL(activated(int)), this, SLOT(on_completion()));
+    m_valid = true;
+}
+
+IoRing::~IoRing()
+{
+    if (m_ring) {
+        io_uring_queue_exit(m_ring);
+        delete m_ring;
+    }
+    for (const FileSlot &file: m_files) {
+        if (file.fd >= 0) {
+            ::close(file.fd);
+        }
+    }
+    if (m_eventFd >= 0) {
+        ::close(m_eventFd);
+    }
+}
+
+bool IoRing::isValid() const
+{
+    return m_valid;
+}
+
+int IoRing::openFile(const QString &path, bool forWrite)
+{
+    int slot = IORING_SOCKET_SLOT + 1;
+    while (slot < IORING_FILES && m_files[slot].fd >= 0) {
+        ++slot;
+    }
+    if (!m_valid || slot == IORING_FILES) {
+        return -1;
+    }
+
+    const QByteArray name = QFile::encodeName(path);
+    int fd = forWrite ? ::open(name.constData(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)
+                      : ::open(name.constData(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (io_uring_register_files_update(m_ring, static_cast<unsigned>(slot), &fd, 1) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    m_files[slot] = FileSlot{fd, 0, false, false, QByteArray(), 0};
+    return slot;
+}
+
+void IoRing::closeFile(int slot)
+{
+    if (slot <= IORING_SOCKET_SLOT || slot >= m_files.size() || m_files[slot].fd < 0) {
+        return;
+    }
+    // Queued writes still land, the slot is released after the last one completes
+    if (m_files[slot].pending == 0) {
+        finishFile(slot);
+    } else {
+        m_files[slot].closing = true;
+    }
+}
+
+void IoRing::finishFile(int slot)
+{
+    int none = -1;
+    io_uring_register_files_update(m_ring, static_cast<unsigned>(slot), &none, 1);
+    ::close(m_files[slot].fd);
+    m_files[slot] = FileSlot{-1, 0, false, false, QByteArray(), 0};
+}
+
+void IoRing::failFile(int slot, const QString &msg)
+{
+    if (!m_files[slot].failed) {
+        m_files[slot].failed = true;
+        emit fileFailed(slot, msg);
+    }
+}
+
+void IoRing::write(int slot, qint64 offset, const QByteArray &data)
+{
+    for (int i = 0; i < data.size(); i += IORING_BUFFER_SIZE) {
+        QByteArray chunk = data.mid(i, IORING_BUFFER_SIZE);
+
+        // Contiguous with a write still waiting for a buffer, just grow that one
+        if (!m_backlog.isEmpty()) {
+            Op &last = m_ops[m_backlog.last()];
+            if (last.type == opType::write && last.slot == slot && last.offset + last.len == offset + i
+                    && last.len + static_cast<quint32>(chunk.size()) <= IORING_BUFFER_SIZE) {
+                last.data.append(chunk);
+                last.len = static_cast<quint32>(last.data.size());
+                continue;
+            }
+        }
+
+        int index = takeOp();
+        m_ops[index] = Op{opType::write, slot, -1, offset + i, static_cast<quint32>(chunk.size()), chunk};
+        ++m_files[slot].pending;
+        m_backlog.append(index);
+    }
+    drainBacklog();
+}
+
+void IoRing::readAll(int slot)
+{
+    struct stat st;
+    if (fstat(m_files[slot].fd, &st) < 0) {
+        failFile(slot, "io_uring: couldn't stat file to read.");
+        return;
+    }
+    if (st.st_size > std::numeric_limits<int>::max()) {
+        failFile(slot, "io_uring: file is too large to read into memory.");
+        return;
+    }
+    m_files[slot].readData = QByteArray(static_cast<int>(st.st_size), Qt::Uninitialized);
+    m_files[slot].readDone = 0;
+    if (st.st_size == 0) {
+        emit readFinished(slot, QByteArray());
+        return;
+    }
+
+    for (qint64 offset = 0; offset < st.st_size; offset += IORING_BUFFER_SIZE) {
+        quint32 len = static_cast<quint32>(qMin<qint64>(IORING_BUFFER_SIZE, st.st_size - offset));
+        int index = takeOp();
+        m_ops[index] = Op{opType::read, slot, -1, offset, len, QByteArray()};
+        ++m_files[slot].pending;
+        m_backlog.append(index);
+    }
+    drainBacklog();
+}
+
+void IoRing::setSocket(qintptr fd)
+{
+    if (!m_valid) {
+        return;
+    }
+    int sock = fd >= 0 ? static_cast<int>(fd) : -1;
+    m_hasSocket = io_uring_register_files_update(m_ring, IORING_SOCKET_SLOT, &sock, 1) >= 0 && sock >= 0;
+}
+
+bool IoRing::send(const QByteArray &datagram)
+{
+    if (!m_hasSocket) {
+        return false;
+    }
+    int index = takeOp();
+    m_ops[index] = Op{opType::send, IORING_SOCKET_SLOT, -1, 0, static_cast<quint32>(datagram.size()), datagram};
+    m_backlog.append(index);
+    drainBacklog();
+    return true;
+}
+
+int IoRing::takeOp()
+{
+    if (m_freeOps.isEmpty()) {
+        m_ops.append(Op());
+        return m_ops.size() - 1;
+    }
+    return m_freeOps.takeLast();
+}
+
+void IoRing::drainBacklog()
+{
+    // Sends never wait behind disk requests that are short of a buffer
+    for (auto it = m_backlog.begin(); it != m_backlog.end();) {
+        Op &op = m_ops[*it];
+        if (op.type != opType::send && m_freeBuffers.isEmpty()) {
+            ++it;
+            continue;
+        }
+        if (!prepare(op, *it)) {
+            break;
+        }
+        it = m_backlog.erase(it);
+    }
+    scheduleFlush();
+}
+
+bool IoRing::prepare(Op &op, int index)
+{
+    io_uring_sqe *sqe = io_uring_get_sqe(m_ring);
+    if (!sqe) {
+        io_uring_submit(m_ring);
+        sqe = io_uring_get_sqe(m_ring);
+        if (!sqe) {
+            return false;
+        }
+    }
+
+    if (op.type == opType::send) {
+        io_uring_prep_send(sqe, IORING_SOCKET_SLOT, op.data.constData(), op.len, 0);
+    } else {
+        op.buffer = m_freeBuffers.takeLast();
+        char *buf = m_bufferPool.data() + op.buffer * IORING_BUFFER_SIZE;
+        if (op.type == opType::write) {
+            memcpy(buf, op.data.constData(), op.len);
+            op.data.clear();
+            io_uring_prep_write_fixed(sqe, op.slot, buf, op.len, static_cast<quint64>(op.offset), op.buffer);
+        } else {
+            io_uring_prep_read_fixed(sqe, op.slot, buf, op.len, static_cast<quint64>(op.offset), op.buffer);
+        }
+    }
+    io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+    io_uring_sqe_set_data(sqe, reinterpret_cast<void *>(static_cast<quintptr>(index)));
+    return true;
+}
+
+void IoRing::scheduleFlush()
+{
+    // Everything queued during this event loop pass goes out with a single io_uring_enter
+    if (!m_flushQueued) {
+        m_flushQueued = true;
+        QMetaObject::invokeMethod(this, "flush", Qt::QueuedConnection);
+    }
+}
+
+void IoRing::flush()
+{
+    m_flushQueued = false;
+    io_uring_submit(m_ring);
+}
+
+void IoRing::on_completion()
+{
+    eventfd_t count;
+    eventfd_read(m_eventFd, &count);
+
+    io_uring_cqe *cqe;
+    while (io_uring_peek_cqe(m_ring, &cqe) == 0) {
+        const int index = static_cast<int>(reinterpret_cast<quintptr>(io_uring_cqe_get_data(cqe)));
+        const int res = cqe->res;
+        io_uring_cqe_seen(m_ring, cqe);
+
+        // Copy out, handlers of our signals may queue new requests and grow m_ops
+        const Op op = m_ops[index];
+        m_ops[index].data.clear();
+        m_freeOps.append(index);
+
+        if (op.type == opType::send) {
+            if (res < 0) {
+                qDebug() << "io_uring send failed:" << strerror(-res);
+            }
+            continue;
+        }
+
+        m_freeBuffers.append(op.buffer);
+        if (res < 0 || static_cast<quint32>(res) != op.len) {
+            // A hole in the middle of a read or write can't be papered over, the whole file is lost
+            failFile(op.slot, "io_uring: " + (res < 0 ? QString::fromLocal8Bit(strerror(-res)) : QString("short read or write.")));
+        } else if (op.type == opType::read) {
+            memcpy(m_files[op.slot].readData.data() + op.offset, m_bufferPool.constData() + op.buffer * IORING_BUFFER_SIZE,
+                   static_cast<size_t>(res));
+            m_files[op.slot].readDone += res;
+        }
+
+        FileSlot &file = m_files[op.slot];
+        if (--file.pending == 0) {
+            if (op.type == opType::read) {
+                QByteArray data = file.readData;
+                file.readData.clear();
+                if (!file.failed && file.readDone == data.size()) {
+                    emit readFinished(op.slot, data);
+                }
+            }
+            if (m_files[op.slot].closing) {
+                finishFile(op.slot);
+            }
+        }
+    }
+    drainBacklog();
+}
@@ -0,0 +1,92 @@
+#ifndef IORING_H
+#define IORING_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QVector>
+#include <QList>
+
+class QSocketNotifier;
+struct io_uring;
+
+// Optional Linux io_uring backend, built with qmake CONFIG+=io_uring.
+// Disk writes, file reads and outgoing datagrams are queued on one ring and
+// submitted together once per event loop pass. File I/O goes through
+// registered buffers and fixed files, completions come back through an
+// eventfd, so a slow disk never blocks packet processing. Receiving is not
+// part of it, incoming datagrams are still read by QUdpSocket.
+// A failed or short read or write marks its file, fileFailed is emitted once
+// and a failed read never reports readFinished.
+class IoRing : public QObject
+{
+    Q_OBJECT
+public:
+    explicit IoRing(QObject *parent = nullptr);
+    ~IoRing();
+
+    bool isValid() const;
+
+    int openFile(const QString &path, bool forWrite);
+    void closeFile(int slot);
+    void write(int slot, qint64 offset, const QByteArray &data);
+    void readAll(int slot);
+
+    void setSocket(qintptr fd);
+    bool send(const QByteArray &datagram);
+
+signals:
+    void readFinished(int slot, const QByteArray &data);
+    void fileFailed(int slot, const QString &msg);
+
+private slots:
+    void on_completion();
+    void flush();
+
+private:
+    enum class opType {
+        write,
+        read,
+        send
+    };
+
+    struct Op {
+        opType type;
+        int slot;
+        int buffer;
+        qint64 offset;
+        quint32 len;
+        QByteArray data;
+    };
+
+    struct FileSlot {
+        int fd;
+        int pending;
+        bool closing;
+        bool failed;
+        QByteArray readData;
+        qint64 readDone;
+    };
+
+    int takeOp();
+    void scheduleFlush();
+    void drainBacklog();
+    bool prepare(Op &op, int index);
+    void finishFile(int slot);
+    void failFile(int slot, const QString &msg);
+
+    io_uring *m_ring;
+    int m_eventFd;
+    QSocketNotifier *m_notifier;
+    bool m_valid;
+    bool m_flushQueued;
+    bool m_hasSocket;
+
+    QByteArray m_bufferPool;
+    QVector<int> m_freeBuffers;
+    QVector<Op> m_ops;
+    QVector<int> m_freeOps;
+    QList<int> m_backlog;
+    QVector<FileSlot> m_files;
+};
+
+#endif // IORING_H
@@ -7,6 +7,8 @@ MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent)
     , ui(new Ui::MainWindow)
     , m_socket(new Socket(this))
+    , m_multicast(new Multicast(this))
+    , m_useMulticast(false)
 {
     ui->setupUi(this);
 
@@ -21,6 +23,8 @@ MainWindow::MainWindow(QWidget *parent)
 
     connect(m_socket, SIGNAL(debugMessage(QString)), this, SLOT(sendToDebug(const QString &)));
     connect(m_socket, SIGNAL(receivedMessage(QString)), this, SLOT(sendToReceive(const QString &)));
+    connect(m_multicast, SIGNAL(debugMessage(QString)), this, SLOT(sendToDebug(const QString &)));
+    connect(m_multicast, SIGNAL(receivedMessage(QString)), this, SLOT(sendToReceive(const QString &)));
 }
 
 MainWindow::~MainWindow()
@@ -56,22 +60,52 @@ void MainWindow::on_connectBtn_clicked()
     QString port = ui->portEditTheir->text();
     QString ip = ui->ipEditTheir->text();
 
+    // In multicast mode "their" address is the group everyone joins
+    if (m_useMulticast) {
+        m_multicast->joinGroup(ip, port);
+        return;
+    }
     m_socket->connectToHost(ip, port);
 }
 
 void MainWindow::on_disconnectBtn_clicked()
 {
+    if (m_useMulticast) {
+        m_multicast->leaveGroup();
+        return;
+    }
     m_socket->disconnect();
 }
 
 void MainWindow::on_sendMsgBtn_clicked()
 {
+    if (m_useMulticast) {
+        m_multicast->sendMessage(ui->inputMsg->toPlainText());
+        return;
+    }
     m_socket->sendMessage(ui->inputMsg->toPlainText());
 }
 
 void MainWindow::on_setFragBtn_clicked()
 {
     m_socket->setFragSize(ui->fragSizeEdit->text().toInt());
+    m_multicast->setFragSize(ui->fragSizeEdit->text().toInt());
+}
+
+void MainWindow::on_setAckBtn_clicked()
+{
+    m_socket->setAckEvery(ui->ackEveryEdit->text().toInt());
+}
+
+void MainWindow::on_setFecBtn_clicked()
+{
+    m_multicast->setFecGroup(ui->fecEdit->text().toInt());
+}
+
+void MainWindow::on_setKeyBtn_clicked()
+{
+    m_socket->setCipher(ui->cipherBox->currentIndex() == 1 ? Aead::Cipher::chaCha20Poly1305 : Aead::Cipher::aes256Gcm);
+    m_socket->setPreSharedKey(ui->pskEdit->text());
 }
 
 void MainWindow::on_fileBtn_clicked()
@@ -83,9 +117,30 @@ void MainWindow::on_fileBtn_clicked()
     ui->labelFileName->setText(fileName);
 }
 
+void MainWindow::on_dirBtn_clicked()
+{
+    QString dirPath(QFileDialog::getExistingDirectory(this, "Select folder", "/home/"));
+    QString dirName(QDir(dirPath).dirName());
+    sendToDebug("Folder to send: " + dirName);
+    m_selectedFile = dirPath;
+    ui->labelFileName->setText(dirName + '/');
+}
+
 void MainWindow::on_sendFileBtn_clicked()
 {
-    m_socket->sendFile(m_selectedFile);
+    if (m_useMulticast) {
+        if (QFileInfo(m_selectedFile).isDir()) {
+            sendToDebug("Folders can't be multicast, select a file.");
+        } else {
+            m_multicast->sendFile(m_selectedFile);
+        }
+        return;
+    }
+    if (QFileInfo(m_selectedFile).isDir()) {
+        m_socket->sendDirectory(m_selectedFile);
+    } else {
+        m_socket->sendFile(m_selectedFile);
+    }
 }
 
 void MainWindow::on_checkBox_stateChanged(int checked)
@@ -96,3 +151,11 @@ void MainWindow::on_checkBox_stateChanged(int checked)
         m_socket->corruptFrag(false);
     }
 }
+
+void MainWindow::on_multicastBox_stateChanged(int checked)
+{
+    m_useMulticast = checked == Qt::CheckState::Checked;
+    if (!m_useMulticast) {
+        m_multicast->leaveGroup();
+    }
+}
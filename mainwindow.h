@@ -4,6 +4,7 @@
 #include <QMainWindow>
 #include <QUdpSocket>
 #include "socket.h"
+#include "multicast.h"
 
 QT_BEGIN_NAMESPACE
 namespace Ui { class MainWindow; }
@@ -28,15 +29,22 @@ private slots:
     void on_disconnectBtn_clicked();
     void on_sendMsgBtn_clicked();
     void on_setFragBtn_clicked();
+    void on_setAckBtn_clicked();
+    void on_setFecBtn_clicked();
+    void on_setKeyBtn_clicked();
     void on_fileBtn_clicked();
+    void on_dirBtn_clicked();
     void on_sendFileBtn_clicked();
     void on_stopServerBtn_clicked();
 
     void on_checkBox_stateChanged(int arg1);
+    void on_multicastBox_stateChanged(int arg1);
 
 private:
     Ui::MainWindow *ui;
     Socket *m_socket;
+    Multicast *m_multicast;
+    bool m_useMulticast;
 
     QString m_selectedFile;
 };
@@ -0,0 +1,728 @@
+#include "multicast.h"
+#include "socket.h"
+#include "treehash.h"
+#include <QNetworkDatagram>
+#include <QFile>
+#include <QFileInfo>
+#include <QDebug>
+#include <QRandomGenerator>
+
+#define MCAST_MAX_FRAG_SIZE 1400
+#define MCAST_FEC_GROUP 8
+#define MCAST_TTL 1
+#define MCAST_BURST 32
+#define MCAST_PACE_MS 1
+#define MCAST_POLL_MS 200
+#define MCAST_POLL_LIMIT 42
+#define MCAST_REPAIR_WINDOW_MS 30
+#define MCAST_NACK_BACKOFF_MS 50
+#define MCAST_DONE_RETRY_MS 500
+#define MCAST_MAX_RANGES 200
+#define MCAST_INIT_HEADER (13 + TREEHASH_SIZE)
+
+enum class mcastType {
+    init = 1,
+    data = 2,
+    parity = 3,
+    nack = 4,
+    join = 5,
+    done = 6,
+    doneAck = 7
+};
+
+// Every fragment is fragSize long except the last one
+static int fragmentLength(quint32 size, int fragSize, quint32 index)
+{
+    return static_cast<int>(qMin<quint32>(static_cast<quint32>(fragSize), size - index * static_cast<quint32>(fragSize)));
+}
+
+static quint32 fragmentCount(quint32 size, int fragSize)
+{
+    return (size + static_cast<quint32>(fragSize) - 1) / static_cast<quint32>(fragSize);
+}
+
+Multicast::Multicast(QObject *parent) : QObject(parent)
+  , m_udpSocket(new QUdpSocket(this))
+  , m_port(0)
+  , m_fragSize(MCAST_MAX_FRAG_SIZE)
+  , m_fecGroup(MCAST_FEC_GROUP)
+  , m_receiverId(QRandomGenerator::global()->generate())
+  , m_sendId(0)
+  , m_sendFragSize(MCAST_MAX_FRAG_SIZE)
+  , m_sendFec(MCAST_FEC_GROUP)
+  , m_sendCount(0)
+  , m_nextFrag(0)
+  , m_pollCount(0)
+  , m_recvId(0)
+  , m_recvSize(0)
+  , m_recvFragSize(0)
+  , m_recvFec(0)
+  , m_missing(0)
+  , m_recvDone(false)
+  , m_recvOk(false)
+  , m_doneAcked(false)
+  , m_doneCount(0)
+{
+    connect(m_udpSocket, SIGNAL(readyRead()), this, SLOT(on_readyRead()));
+
+    m_paceTimer.setInterval(MCAST_PACE_MS);
+    m_paceTimer.setCallback([this]() { on_pace_timeout(); });
+
+    m_pollTimer.setInterval(MCAST_POLL_MS);
+    m_pollTimer.setCallback([this]() { on_poll_timeout(); });
+
+    m_repairTimer.setInterval(MCAST_REPAIR_WINDOW_MS);
+    m_repairTimer.setCallback([this]() { on_repair_timeout(); });
+
+    m_nackTimer.setCallback([this]() { on_nack_timeout(); });
+
+    m_doneTimer.setInterval(MCAST_DONE_RETRY_MS);
+    m_doneTimer.setCallback([this]() { on_done_timeout(); });
+}
+
+bool Multicast::joinGroup(const QString &ipString, const QString &portString)
+{
+    QHostAddress group(ipString);
+    if (!group.isMulticast()) {
+        emit debugMessage("Not a multicast group address: " + ipString);
+        return false;
+    }
+    leaveGroup();
+    m_group = group;
+    m_port = portString.toUShort();
+
+    // Shared bind, every sender and receiver on this host listens on the group port
+    if (!m_udpSocket->bind(QHostAddress::AnyIPv4, m_port, QUdpSocket::ShareAddress | QUdpSocket::ReuseAddressHint)) {
+        emit debugMessage("Couldn't bind multicast port " + portString + ": " + m_udpSocket->errorString());
+        return false;
+    }
+    m_udpSocket->setSocketOption(QAbstractSocket::MulticastTtlOption, MCAST_TTL);
+    m_udpSocket->setSocketOption(QAbstractSocket::MulticastLoopbackOption, 1);
+    if (!m_udpSocket->joinMulticastGroup(m_group)) {
+        emit debugMessage("Couldn't join multicast group " + ipString + ": " + m_udpSocket->errorString());
+        m_udpSocket->close();
+        return false;
+    }
+    emit debugMessage("Joined multicast group " + ipString + ':' + portString + " as receiver " + QString::number(m_receiverId, 16));
+    return true;
+}
+
+void Multicast::leaveGroup()
+{
+    m_paceTimer.stop();
+    m_pollTimer.stop();
+    m_repairTimer.stop();
+    m_nackTimer.stop();
+    m_doneTimer.stop();
+    if (m_udpSocket->state() == QAbstractSocket::BoundState) {
+        m_udpSocket->leaveMulticastGroup(m_group);
+        m_udpSocket->close();
+        emit debugMessage("Left multicast group " + m_group.toString());
+    }
+}
+
+bool Multicast::isJoined() const
+{
+    return m_udpSocket->state() == QAbstractSocket::BoundState;
+}
+
+// Both only apply to the next transfer, a running one keeps what its INIT announced
+void Multicast::setFragSize(int fragSize)
+{
+    if (fragSize < 1 || fragSize > MCAST_MAX_FRAG_SIZE) {
+        emit debugMessage("Multicast fragment size must be 1 to " + QString::number(MCAST_MAX_FRAG_SIZE) + ", multicast fragment size not set!");
+        return;
+    }
+    m_fragSize = fragSize;
+    emit debugMessage("Multicast fragment size set to: " + QString::number(m_fragSize));
+}
+
+void Multicast::setFecGroup(int fecGroup)
+{
+    // 0 turns parity repairs off, every loss is repaired with the fragment itself
+    if (fecGroup < 0 || fecGroup > 255) {
+        emit debugMessage("FEC group must be 0 to 255, FEC group not set!");
+        return;
+    }
+    m_fecGroup = fecGroup;
+    emit debugMessage("FEC group set to: " + QString::number(m_fecGroup)
+                      + (m_fecGroup == 0 ? ", parity repairs off." : " fragments per parity packet."));
+}
+
+void Multicast::sendPacket(const QByteArray &data)
+{
+    QByteArray packet(data);
+    packet.append(Socket::checksum(data));
+    m_udpSocket->writeDatagram(packet, m_group, m_port);
+}
+
+void Multicast::sendMessage(const QString &msg)
+{
+    startTransfer(msg.toLatin1(), QByteArray(1, '\x01'));
+}
+
+void Multicast::sendFile(const QString &filePath)
+{
+    QFile fileToSend(filePath);
+    if (!fileToSend.open(QIODevice::ReadOnly)) {
+        emit debugMessage("Couldn't open file: " + filePath);
+        return;
+    }
+    startTransfer(fileToSend.readAll(), QFileInfo(filePath).fileName().toUtf8());
+}
+
+void Multicast::startTransfer(const QByteArray &payload, const QByteArray &name)
+{
+    if (!isJoined()) {
+        emit debugMessage("Join a multicast group first.");
+        return;
+    }
+    do {
+        m_sendId = QRandomGenerator::global()->generate();
+    } while (m_sendId == 0);
+
+    m_sendPayload = payload;
+    m_sendFragSize = m_fragSize;
+    m_sendFec = m_fecGroup;
+    m_sendCount = fragmentCount(static_cast<quint32>(payload.size()), m_sendFragSize);
+    m_nextFrag = 0;
+    m_repairQueue.clear();
+    m_repairWanted.fill(false, static_cast<int>(m_sendCount));
+    m_groupWorstLoss.fill(0, m_sendFec > 0 ? static_cast<int>((m_sendCount + m_sendFec - 1) / m_sendFec) : 0);
+    m_receivers.clear();
+    m_pollCount = 0;
+
+    // INIT: [type][id 4][size 4][frag size 2][fec group][poll][tree hash 32][name]
+    QByteArray init;
+    init.append(static_cast<char>(mcastType::init));
+    init.append(Socket::intToArray(m_sendId));
+    init.append(Socket::intToArray(static_cast<quint32>(payload.size())));
+    init.append(Socket::intToArray(static_cast<quint16>(m_sendFragSize)));
+    init.append(static_cast<char>(m_sendFec));
+    init.append('\0');
+    init.append(TreeHash::hash(payload));
+    init.append(name);
+    m_sendInit = init;
+
+    emit debugMessage("Multicasting " + QString::number(payload.size()) + " bytes in " + QString::number(m_sendCount) + " fragments.");
+    sendPacket(m_sendInit);
+    m_pollTimer.stop();
+    m_paceTimer.start();
+}
+
+QByteArray Multicast::dataPacket(quint32 index) const
+{
+    QByteArray packet;
+    packet.append(static_cast<char>(mcastType::data));
+    packet.append(Socket::intToArray(m_sendId));
+    packet.append(Socket::intToArray(index));
+    packet.append(m_sendPayload.mid(static_cast<int>(index) * m_sendFragSize, m_sendFragSize));
+    return packet;
+}
+
+QByteArray Multicast::parityPacket(quint32 group) const
+{
+    // XOR over the group's fragments, the short last fragment counts as zero padded
+    QByteArray parity(m_sendFragSize, '\0');
+    const quint32 first = group * static_cast<quint32>(m_sendFec);
+    const quint32 last = qMin(first + static_cast<quint32>(m_sendFec), m_sendCount);
+    for (quint32 i = first; i < last; ++i) {
+        const char *frag = m_sendPayload.constData() + i * static_cast<quint32>(m_sendFragSize);
+        const int len = fragmentLength(static_cast<quint32>(m_sendPayload.size()), m_sendFragSize, i);
+        for (int j = 0; j < len; ++j) {
+            parity[j] = static_cast<char>(parity[j] ^ frag[j]);
+        }
+    }
+    QByteArray packet;
+    packet.append(static_cast<char>(mcastType::parity));
+    packet.append(Socket::intToArray(m_sendId));
+    packet.append(Socket::intToArray(group));
+    packet.append(parity);
+    return packet;
+}
+
+bool Multicast::allReceiversDone() const
+{
+    if (m_receivers.isEmpty()) {
+        return false;
+    }
+    for (bool done: m_receivers) {
+        if (!done) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Multicast::on_pace_timeout()
+{
+    // Repairs go ahead of fresh data, a small burst per tick keeps receive buffers from overflowing
+    int budget = MCAST_BURST;
+    while (budget > 0 && !m_repairQueue.isEmpty()) {
+        sendPacket(m_repairQueue.takeFirst());
+        --budget;
+    }
+    while (budget > 0 && m_nextFrag < m_sendCount) {
+        sendPacket(dataPacket(m_nextFrag++));
+        --budget;
+    }
+    if (!m_repairQueue.isEmpty() || m_nextFrag < m_sendCount) {
+        m_paceTimer.start();
+    } else if (!m_pollTimer.isActive() && !allReceiversDone()) {
+        m_pollTimer.start();
+    }
+}
+
+void Multicast::on_poll_timeout()
+{
+    if (allReceiversDone()) {
+        return;
+    }
+    // Re-sent INIT with the poll flag: late joiners pick up the transfer, everyone else reports gaps
+    if (!m_paceTimer.isActive()) {
+        if (++m_pollCount > MCAST_POLL_LIMIT) {
+            int done = 0;
+            for (bool receiverDone: m_receivers) {
+                done += receiverDone ? 1 : 0;
+            }
+            emit debugMessage("Multicast transfer gave up, " + QString::number(done) + '/' + QString::number(m_receivers.size()) + " receivers finished.");
+            return;
+        }
+        m_sendInit[12] = '\1';
+        sendPacket(m_sendInit);
+    }
+    m_pollTimer.start();
+}
+
+void Multicast::on_repair_timeout()
+{
+    int parities = 0;
+    int fragments = 0;
+    for (quint32 i = 0; i < m_sendCount; ++i) {
+        if (!m_repairWanted.testBit(static_cast<int>(i))) {
+            continue;
+        }
+        if (m_sendFec > 0) {
+            const quint32 group = i / static_cast<quint32>(m_sendFec);
+            const quint32 last = qMin((group + 1) * static_cast<quint32>(m_sendFec), m_sendCount);
+            int wanted = 0;
+            for (quint32 j = i; j < last; ++j) {
+                wanted += m_repairWanted.testBit(static_cast<int>(j)) ? 1 : 0;
+            }
+            // One parity packet repairs every receiver that lost a single fragment of the group
+            if (wanted >= 2 && m_groupWorstLoss[static_cast<int>(group)] == 1) {
+                m_repairQueue.append(parityPacket(group));
+                ++parities;
+                i = last - 1;
+                continue;
+            }
+        }
+        m_repairQueue.append(dataPacket(i));
+        ++fragments;
+    }
+    m_repairWanted.fill(false);
+    m_groupWorstLoss.fill(0);
+
+    emit debugMessage("Repair round: " + QString::number(fragments) + " fragments, " + QString::number(parities) + " parity packets.");
+    if (!m_paceTimer.isActive()) {
+        m_paceTimer.start();
+    }
+}
+
+void Multicast::on_nack_timeout()
+{
+    if (m_recvDone) {
+        return;
+    }
+    // An empty file has nothing to ask for, a failed write is simply tried again
+    if (m_missing == 0) {
+        finishReceive();
+        return;
+    }
+    // NACK: [type][id 4][receiver 4][range count 2] count * [first 4][length 2]
+    const int count = m_have.size();
+
+    // The sender picks parity by the worst per group loss it hears. A group we lost
+    // two or more of is reported in full even if others asked for the same
+    // fragments, so one parity packet is never sent where we'd need two.
+    QVector<int> groupMissing;
+    if (m_recvFec > 0) {
+        groupMissing.fill(0, (count + m_recvFec - 1) / m_recvFec);
+        for (int i = 0; i < count; ++i) {
+            groupMissing[i / m_recvFec] += m_have.testBit(i) ? 0 : 1;
+        }
+    }
+    auto wanted = [&](int i) {
+        if (m_have.testBit(i)) {
+            return false;
+        }
+        return !m_heard.testBit(i) || (m_recvFec > 0 && groupMissing[i / m_recvFec] >= 2);
+    };
+
+    QByteArray ranges;
+    quint16 rangeCount = 0;
+    for (int i = 0; i < count && rangeCount < MCAST_MAX_RANGES; ++i) {
+        if (!wanted(i)) {
+            continue;
+        }
+        int end = i;
+        while (end + 1 < count && end - i < 0xffff - 1 && wanted(end + 1)) {
+            ++end;
+        }
+        ranges.append(Socket::intToArray(static_cast<quint32>(i)));
+        ranges.append(Socket::intToArray(static_cast<quint16>(end - i + 1)));
+        ++rangeCount;
+        i = end;
+    }
+    if (rangeCount == 0) {
+        qDebug() << "nack suppressed, single losses already requested by other receivers";
+        return;
+    }
+
+    QByteArray nack;
+    nack.append(static_cast<char>(mcastType::nack));
+    nack.append(Socket::intToArray(m_recvId));
+    nack.append(Socket::intToArray(m_receiverId));
+    nack.append(Socket::intToArray(rangeCount));
+    nack.append(ranges);
+    emit debugMessage("Missing " + QString::number(m_missing) + " fragments, sending NACK.");
+    sendPacket(nack);
+}
+
+void Multicast::on_done_timeout()
+{
+    if (m_doneAcked || ++m_doneCount > MCAST_POLL_LIMIT) {
+        return;
+    }
+    sendDone();
+    m_doneTimer.start();
+}
+
+void Multicast::sendDone()
+{
+    QByteArray done;
+    done.append(static_cast<char>(mcastType::done));
+    done.append(Socket::intToArray(m_recvId));
+    done.append(Socket::intToArray(m_receiverId));
+    done.append(static_cast<char>(m_recvOk ? 1 : 0));
+    sendPacket(done);
+}
+
+void Multicast::on_got_init(const QByteArray &data)
+{
+    if (data.size() < MCAST_INIT_HEADER) {
+        return;
+    }
+    const quint32 id = Socket::arrToInt(data.mid(1, 4));
+    if (id == m_sendId) {
+        return;
+    }
+
+    if (id != m_recvId) {
+        const int fragSize = Socket::arrToCheck(data.mid(9, 2));
+        if (fragSize == 0) {
+            return;
+        }
+        m_recvId = id;
+        m_recvSize = Socket::arrToInt(data.mid(5, 4));
+        m_recvFragSize = fragSize;
+        m_recvFec = static_cast<quint8>(data[11]);
+        m_recvHash = data.mid(13, TREEHASH_SIZE);
+        m_recvName = data.mid(MCAST_INIT_HEADER);
+        m_missing = fragmentCount(m_recvSize, m_recvFragSize);
+        m_recvFrags.fill(QByteArray(), static_cast<int>(m_missing));
+        m_have.fill(false, static_cast<int>(m_missing));
+        m_heard.fill(false, static_cast<int>(m_missing));
+        m_recvDone = false;
+        m_recvOk = false;
+        m_doneAcked = false;
+        m_doneCount = 0;
+        m_nackTimer.stop();
+        m_doneTimer.stop();
+        emit debugMessage("Multicast transfer " + QString::number(id, 16) + ": " + QString::number(m_recvSize) + " bytes in " + QString::number(m_missing) + " fragments.");
+
+        QByteArray join;
+        join.append(static_cast<char>(mcastType::join));
+        join.append(Socket::intToArray(m_recvId));
+        join.append(Socket::intToArray(m_receiverId));
+        sendPacket(join);
+
+        if (m_missing == 0) {
+            finishReceive();
+            return;
+        }
+    }
+
+    if (data[12] == '\0') {
+        return;
+    }
+    if (m_recvDone) {
+        if (!m_doneAcked) {
+            sendDone();
+        }
+        return;
+    }
+    // Random backoff, whoever NACKs first saves the others from repeating it
+    m_heard.fill(false);
+    m_nackTimer.setInterval(1 + static_cast<int>(QRandomGenerator::global()->bounded(MCAST_NACK_BACKOFF_MS)));
+    m_nackTimer.start();
+}
+
+void Multicast::on_got_data(const QByteArray &data)
+{
+    if (data.size() < 9 || Socket::arrToInt(data.mid(1, 4)) != m_recvId || m_recvDone) {
+        return;
+    }
+    const quint32 index = Socket::arrToInt(data.mid(5, 4));
+    if (index >= static_cast<quint32>(m_have.size()) || m_have.testBit(static_cast<int>(index))) {
+        return;
+    }
+    QByteArray payload = data.mid(9);
+    if (payload.size() != fragmentLength(m_recvSize, m_recvFragSize, index)) {
+        return;
+    }
+    m_recvFrags[static_cast<int>(index)] = payload;
+    m_have.setBit(static_cast<int>(index));
+    if (--m_missing == 0) {
+        finishReceive();
+    }
+}
+
+void Multicast::on_got_parity(const QByteArray &data)
+{
+    if (m_recvFec == 0 || data.size() != 9 + m_recvFragSize
+            || Socket::arrToInt(data.mid(1, 4)) != m_recvId || m_recvDone) {
+        return;
+    }
+    const quint32 count = static_cast<quint32>(m_have.size());
+    const quint32 first = Socket::arrToInt(data.mid(5, 4)) * static_cast<quint32>(m_recvFec);
+    const quint32 last = qMin(first + static_cast<quint32>(m_recvFec), count);
+    int lost = -1;
+    for (quint32 i = first; i < last; ++i) {
+        if (!m_have.testBit(static_cast<int>(i))) {
+            if (lost >= 0) {
+                // More than one hole, parity can't help, the next poll asks for fragments
+                return;
+            }
+            lost = static_cast<int>(i);
+        }
+    }
+    if (lost < 0) {
+        return;
+    }
+
+    QByteArray rebuilt = data.mid(9);
+    for (quint32 i = first; i < last; ++i) {
+        const QByteArray &frag = m_recvFrags[static_cast<int>(i)];
+        for (int j = 0; j < frag.size(); ++j) {
+            rebuilt[j] = static_cast<char>(rebuilt[j] ^ frag[j]);
+        }
+    }
+    rebuilt.truncate(fragmentLength(m_recvSize, m_recvFragSize, static_cast<quint32>(lost)));
+    m_recvFrags[lost] = rebuilt;
+    m_have.setBit(lost);
+    qDebug() << "rebuilt fragment" << lost << "from parity";
+    if (--m_missing == 0) {
+        finishReceive();
+    }
+}
+
+void Multicast::on_got_nack(const QByteArray &data)
+{
+    if (data.size() < 11) {
+        return;
+    }
+    const quint32 id = Socket::arrToInt(data.mid(1, 4));
+    const quint32 receiver = Socket::arrToInt(data.mid(5, 4));
+    const int rangeCount = qMin<int>(Socket::arrToCheck(data.mid(9, 2)), (data.size() - 11) / 6);
+
+    if (id == m_sendId) {
+        if (!m_receivers.contains(receiver)) {
+            m_receivers.insert(receiver, false);
+        }
+        // Per group loss of this one receiver decides between parity and plain repairs
+        QHash<quint32, quint32> groupLoss;
+        for (int r = 0; r < rangeCount; ++r) {
+            const quint32 start = Socket::arrToInt(data.mid(11 + r * 6, 4));
+            const quint32 end = qMin(start + Socket::arrToCheck(data.mid(15 + r * 6, 2)), m_sendCount);
+            for (quint32 i = start; i < end; ++i) {
+                m_repairWanted.setBit(static_cast<int>(i));
+                if (m_sendFec > 0) {
+                    ++groupLoss[i / static_cast<quint32>(m_sendFec)];
+                }
+            }
+        }
+        for (auto it = groupLoss.constBegin(); it != groupLoss.constEnd(); ++it) {
+            quint32 &worst = m_groupWorstLoss[static_cast<int>(it.key())];
+            worst = qMax(worst, it.value());
+        }
+        m_pollCount = 0;
+        if (!m_repairTimer.isActive()) {
+            m_repairTimer.start();
+        }
+    } else if (id == m_recvId && receiver != m_receiverId && !m_recvDone) {
+        // Someone else asked for these, no need to ask again this round
+        for (int r = 0; r < rangeCount; ++r) {
+            const quint32 start = Socket::arrToInt(data.mid(11 + r * 6, 4));
+            const quint32 end = qMin(start + Socket::arrToCheck(data.mid(15 + r * 6, 2)), static_cast<quint32>(m_heard.size()));
+            for (quint32 i = start; i < end; ++i) {
+                m_heard.setBit(static_cast<int>(i));
+            }
+        }
+    }
+}
+
+void Multicast::on_got_join(const QByteArray &data)
+{
+    if (data.size() < 9 || Socket::arrToInt(data.mid(1, 4)) != m_sendId) {
+        return;
+    }
+    const quint32 receiver = Socket::arrToInt(data.mid(5, 4));
+    if (!m_receivers.contains(receiver)) {
+        m_receivers.insert(receiver, false);
+        emit debugMessage("Receiver " + QString::number(receiver, 16) + " joined, " + QString::number(m_receivers.size()) + " receivers.");
+    }
+}
+
+void Multicast::on_got_done(const QByteArray &data)
+{
+    if (data.size() < 10 || Socket::arrToInt(data.mid(1, 4)) != m_sendId) {
+        return;
+    }
+    const quint32 receiver = Socket::arrToInt(data.mid(5, 4));
+
+    // A receiver whose hash didn't match or that couldn't write the file threw its copy away,
+    // it's polled until it gets a good one
+    if (!data[9]) {
+        m_receivers.insert(receiver, false);
+        emit debugMessage("Receiver " + QString::number(receiver, 16) + " FAILED the integrity check or the write, polling it again.");
+        m_pollCount = 0;
+        if (!m_pollTimer.isActive() && !m_paceTimer.isActive()) {
+            m_pollTimer.start();
+        }
+        return;
+    }
+
+    QByteArray ack;
+    ack.append(static_cast<char>(mcastType::doneAck));
+    ack.append(Socket::intToArray(m_sendId));
+    ack.append(Socket::intToArray(receiver));
+    sendPacket(ack);
+
+    if (m_receivers.value(receiver, false)) {
+        return;
+    }
+    m_receivers.insert(receiver, true);
+    int done = 0;
+    for (bool receiverDone: m_receivers) {
+        done += receiverDone ? 1 : 0;
+    }
+    emit debugMessage("Receiver " + QString::number(receiver, 16) + " finished, "
+                      + QString::number(done) + '/' + QString::number(m_receivers.size()) + " done.");
+    if (allReceiversDone()) {
+        emit debugMessage("Multicast transfer complete, all " + QString::number(m_receivers.size()) + " receivers finished.");
+        m_pollTimer.stop();
+    }
+}
+
+void Multicast::on_got_doneAck(const QByteArray &data)
+{
+    if (data.size() < 9 || Socket::arrToInt(data.mid(1, 4)) != m_recvId
+            || Socket::arrToInt(data.mid(5, 4)) != m_receiverId) {
+        return;
+    }
+    m_doneAcked = true;
+    m_doneTimer.stop();
+}
+
+void Multicast::finishReceive()
+{
+    m_nackTimer.stop();
+
+    QByteArray payload;
+    payload.reserve(static_cast<int>(m_recvSize));
+    for (const QByteArray &frag: m_recvFrags) {
+        payload.append(frag);
+    }
+
+    QByteArray digest = TreeHash::hash(payload);
+    m_recvOk = digest == m_recvHash;
+    if (!m_recvOk) {
+        // No telling which fragment is bad, start over and NACK everything on the next poll
+        emit debugMessage("Multicast transfer received, integrity check FAILED, expected " + m_recvHash.toHex() + " got " + digest.toHex()
+                          + ". Discarding it and asking for all of it again.");
+        discardReceive();
+        return;
+    }
+    emit debugMessage("Multicast transfer received, integrity check passed, tree hash: " + digest.toHex());
+
+    if (m_recvName == QByteArray(1, '\x01')) {
+        emit receivedMessage(QString::fromLatin1(payload));
+    } else {
+        QFile file(QFileInfo(QString::fromUtf8(m_recvName)).fileName());
+        if (!file.open(QIODevice::WriteOnly) || file.write(payload) != payload.size() || !file.flush()) {
+            // Same as a bad hash, the sender keeps polling and the next complete copy is written again
+            emit debugMessage("Couldn't write received file " + file.fileName() + ": " + file.errorString()
+                              + ". Discarding it and asking for all of it again.");
+            m_recvOk = false;
+            discardReceive();
+            return;
+        }
+        emit debugMessage("Received file: " + file.fileName());
+    }
+    m_recvDone = true;
+    m_recvFrags.clear();
+
+    sendDone();
+    m_doneTimer.start();
+}
+
+void Multicast::discardReceive()
+{
+    const int count = m_have.size();
+    m_recvFrags.fill(QByteArray(), count);
+    m_have.fill(false);
+    m_heard.fill(false);
+    m_missing = static_cast<quint32>(count);
+    sendDone();
+}
+
+void Multicast::on_readyRead()
+{
+    while (m_udpSocket->hasPendingDatagrams()) {
+        QByteArray recData = m_udpSocket->receiveDatagram().data();
+        if (recData.size() < 3) {
+            continue;
+        }
+        QByteArray chsum = Socket::checksum(recData.mid(0, recData.size() - 2));
+        if (chsum != recData.mid(recData.size() - 2, 2)) {
+            qDebug() << "multicast checksum doesn't match";
+            continue;
+        }
+        recData.chop(2);
+
+        switch (mcastType(recData[0])) {
+        case mcastType::init:
+            on_got_init(recData);
+            break;
+        case mcastType::data:
+            on_got_data(recData);
+            break;
+        case mcastType::parity:
+            on_got_parity(recData);
+            break;
+        case mcastType::nack:
+            on_got_nack(recData);
+            break;
+        case mcastType::join:
+            on_got_join(recData);
+            break;
+        case mcastType::done:
+            on_got_done(recData);
+            break;
+        case mcastType::doneAck:
+            on_got_doneAck(recData);
+            break;
+        }
+    }
+}
@@ -0,0 +1,112 @@
+#ifndef MULTICAST_H
+#define MULTICAST_H
+
+#include <QObject>
+#include <QUdpSocket>
+#include <QHostAddress>
+#include <QBitArray>
+#include <QHash>
+#include <QList>
+#include <QVector>
+#include "timerwheel.h"
+
+// One-to-many push over a multicast group. The sender transmits every
+// fragment once. Receivers report gaps with NACKs sent to the whole group,
+// so a receiver that hears its gaps already requested stays silent. The
+// sender aggregates NACKs for a short window and multicasts one round of
+// repairs: XOR parity for groups where no receiver reported more than one
+// loss, the fragments themselves otherwise. Every receiver confirms with
+// DONE, so completion is tracked per receiver. A receiver whose tree hash
+// doesn't match reports a failed DONE, drops its copy and is polled again.
+// All control traffic goes to the group as well, so any number of
+// instances can share the port on one host. For loopback only:
+// ip link set lo multicast on; ip route add 239.0.0.0/8 dev lo
+class Multicast : public QObject
+{
+    Q_OBJECT
+public:
+    explicit Multicast(QObject *parent = nullptr);
+
+    bool joinGroup(const QString &ip, const QString &port);
+    void leaveGroup();
+    bool isJoined() const;
+
+    void sendMessage(const QString &);
+    void sendFile(const QString &);
+    void setFragSize(int);
+    void setFecGroup(int);
+
+signals:
+    void debugMessage(const QString &);
+    void receivedMessage(const QString &);
+
+private slots:
+    void on_readyRead();
+    void on_pace_timeout();
+    void on_poll_timeout();
+    void on_repair_timeout();
+    void on_nack_timeout();
+    void on_done_timeout();
+
+protected:
+    void on_got_init(const QByteArray &data);
+    void on_got_data(const QByteArray &data);
+    void on_got_parity(const QByteArray &data);
+    void on_got_nack(const QByteArray &data);
+    void on_got_join(const QByteArray &data);
+    void on_got_done(const QByteArray &data);
+    void on_got_doneAck(const QByteArray &data);
+
+    void sendPacket(const QByteArray &data);
+    void startTransfer(const QByteArray &payload, const QByteArray &name);
+    QByteArray dataPacket(quint32 index) const;
+    QByteArray parityPacket(quint32 group) const;
+    void finishReceive();
+    void discardReceive();
+    void sendDone();
+    bool allReceiversDone() const;
+
+private:
+    QUdpSocket *m_udpSocket;
+    QHostAddress m_group;
+    quint16 m_port;
+    int m_fragSize;
+    int m_fecGroup;
+    quint32 m_receiverId;
+
+    WheelTimer m_paceTimer;
+    WheelTimer m_pollTimer;
+    WheelTimer m_repairTimer;
+    WheelTimer m_nackTimer;
+    WheelTimer m_doneTimer;
+
+    quint32 m_sendId;
+    int m_sendFragSize;
+    int m_sendFec;
+    QByteArray m_sendPayload;
+    QByteArray m_sendInit;
+    quint32 m_sendCount;
+    quint32 m_nextFrag;
+    QList<QByteArray> m_repairQueue;
+    QBitArray m_repairWanted;
+    QVector<quint32> m_groupWorstLoss;
+    QHash<quint32, bool> m_receivers;
+    int m_pollCount;
+
+    quint32 m_recvId;
+    quint32 m_recvSize;
+    int m_recvFragSize;
+    int m_recvFec;
+    QByteArray m_recvName;
+    QByteArray m_recvHash;
+    QVector<QByteArray> m_recvFrags;
+    QBitArray m_have;
+    QBitArray m_heard;
+    quint32 m_missing;
+    bool m_recvDone;
+    bool m_recvOk;
+    bool m_doneAcked;
+    int m_doneCount;
+};
+
+#endif // MULTICAST_H
@@ -4,12 +4,23 @@
 #include <QIODevice>
 #include <QtMath>
 #include <QFileDialog>
+#include <QDirIterator>
+#include <QtConcurrent>
+#include <QDateTime>
+#include <QRandomGenerator>
+#ifdef UDPCOMM_IO_URING
+#include "ioring.h"
+#endif
 
 #define CONNECTION_TIMEOUT_MS 72000
-#define HANDSHAKE_TIMEOUT_MS 60000
+#define KEEPALIVE_TIMEOUT_MS 20000
+#define SESSION_TICKET_LIFETIME_MS 600000
 #define REPEAT_LIMIT 42
-#define MAX_FRAG_SIZE 1446
+#define MAX_FRAG_SIZE 1440
 #define ACK_CONFIRM 20
+#define ACK_DELAY_MS 40
+// A directory travels as one QByteArray, which can't grow past just under 2 GiB
+#define MAX_STREAM_SIZE 0x7fffffe0
 
 enum class packetType {
     handshake = 1,
@@ -17,7 +28,13 @@ enum class packetType {
     ack = 4,
     init = 8,
     data = 16,
-    error = 32
+    error = 32,
+    keepalive = 64
+};
+
+enum class initType {
+    message = 1,
+    directory = 2
 };
 
 enum class ackType {
@@ -33,47 +50,107 @@ Socket::Socket(QObject *parent) : QObject(parent)
   , m_retrySynCount(0)
   , m_retryInitCount(0)
   , m_retryDataCount(0)
+  , m_blockToSend(0)
+  , m_blocksHashed(0)
+  , m_sendFragSize(MAX_FRAG_SIZE)
+  , m_ackEvery(ACK_CONFIRM)
+  , m_ackBlock(ACK_CONFIRM)
+  , m_holdAck(false)
   , m_server(false)
   , m_sendCurrupt(false)
+  , m_resumeTicket(0)
+  , m_resumeAccepted(false)
+  , m_cipher(Aead::Cipher::aes256Gcm)
+  , m_io(nullptr)
+  , m_fileSlot(-1)
+  , m_fileOffset(0)
+  , m_fileFailed(false)
+  , m_dirWatcher(new QFutureWatcher<FileData>(this))
+  , m_isDirectory(false)
+  , m_dirEntryCount(-1)
+  , m_dirFileIndex(0)
+  , m_dirWritten(0)
+  , m_dirComplete(false)
 {
     connect(m_udpSocket, SIGNAL(readyRead()), this, SLOT(on_readyRead()));
     connect(m_udpSocket, SIGNAL(connected()), this, SLOT(on_connected()));
     connect(m_udpSocket, SIGNAL(disconnected()), this, SLOT(on_disconnected()));
+    connect(m_dirWatcher, SIGNAL(finished()), this, SLOT(on_directoryRead()));
+
+    m_connectionTimer.setInterval(CONNECTION_TIMEOUT_MS);
+    m_connectionTimer.setCallback([this]() { on_connection_timeout(); });
+
+    m_keepaliveTimer.setInterval(KEEPALIVE_TIMEOUT_MS);
+    m_keepaliveTimer.setCallback([this]() { on_keepalive_timeout(); });
+
+    m_retryHandshakeTimer.setInterval(1000);
+    m_retryHandshakeTimer.setCallback([this]() { on_retryHandshake_timeout(); });
 
-    m_connectionTimer = new QTimer(this);
-    m_connectionTimer->setInterval(CONNECTION_TIMEOUT_MS);
-    m_connectionTimer->setSingleShot(true);
-    connect(m_connectionTimer, SIGNAL(timeout()), this, SLOT(on_connection_timeout()));
+    m_retrySynTimer.setInterval(1000);
+    m_retrySynTimer.setCallback([this]() { on_retrySyn_timeout(); });
 
-    m_handshakeTimer = new QTimer(this);
-    m_handshakeTimer->setInterval(HANDSHAKE_TIMEOUT_MS);
-    m_handshakeTimer->setSingleShot(false);
-    connect(m_handshakeTimer, SIGNAL(timeout()), this, SLOT(on_handshake_timeout()));
+    m_retryInitTimer.setInterval(1000);
+    m_retryInitTimer.setCallback([this]() { on_retryInit_timeout(); });
 
-    m_retryHandshakeTimer = new QTimer(this);
-    m_retryHandshakeTimer->setInterval(1000);
-    m_retryHandshakeTimer->setSingleShot(true);
-    connect(m_retryHandshakeTimer, SIGNAL(timeout()), this, SLOT(on_retryHandshake_timeout()));
+    m_retryDataTimer.setInterval(3000);
+    m_retryDataTimer.setCallback([this]() { on_retryData_timeout(); });
 
-    m_retrySynTimer = new QTimer(this);
-    m_retrySynTimer->setInterval(1000);
-    m_retrySynTimer->setSingleShot(true);
-    connect(m_retrySynTimer, SIGNAL(timeout()), this, SLOT(on_retrySyn_timeout()));
+    m_dataTimer.setInterval(1000);
+    m_dataTimer.setCallback([this]() { on_data_timeout(); });
 
-    m_retryInitTimer = new QTimer(this);
-    m_retryInitTimer->setInterval(1000);
-    m_retryInitTimer->setSingleShot(true);
-    connect(m_retryInitTimer, SIGNAL(timeout()), this, SLOT(on_retryInit_timeout()));
+    m_ackDelayTimer.setInterval(ACK_DELAY_MS);
+    m_ackDelayTimer.setCallback([this]() { on_ackDelay_timeout(); });
+
+    m_ticketTimer.setCallback([this]() { on_ticket_timeout(); });
+
+#ifdef UDPCOMM_IO_URING
+    m_io = new IoRing(this);
+    if (m_io->isValid()) {
+        connect(m_io, SIGNAL(readFinished(int, QByteArray)), this, SLOT(on_fileRead(int, QByteArray)));
+        connect(m_io, SIGNAL(fileFailed(int, QString)), this, SLOT(on_fileFailed(int, QString)));
+    } else {
+        delete m_io;
+        m_io = nullptr;
+    }
+#endif
+}
 
-    m_retryDataTimer = new QTimer(this);
-    m_retryDataTimer->setInterval(3000);
-    m_retryDataTimer->setSingleShot(true);
-    connect(m_retryDataTimer, SIGNAL(timeout()), this, SLOT(on_retryData_timeout()));
+static Socket::FileData readWholeFile(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return Socket::FileData{QByteArray(), false};
+    }
+    QByteArray content = file.readAll();
+    return Socket::FileData{content, file.error() == QFileDevice::NoError};
+}
 
-    m_dataTimer = new QTimer(this);
-    m_dataTimer->setInterval(1000);
-    m_dataTimer->setSingleShot(true);
-    connect(m_dataTimer, SIGNAL(timeout()), this, SLOT(on_data_timeout()));
+static Socket::WriteResult writeWholeFile(const QString &path, const QByteArray &content, quint16 mode)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return Socket::WriteResult::failed;
+    }
+    bool ok = file.write(content) == content.size() && file.flush();
+    file.close();
+    if (!ok) {
+        return Socket::WriteResult::failed;
+    }
+    // The content is on disk either way, a mode we can't apply doesn't lose the file
+    if (!file.setPermissions(QFileDevice::Permissions(mode))) {
+        return Socket::WriteResult::modeFailed;
+    }
+    return Socket::WriteResult::written;
+}
+
+// Paths from the manifest must stay inside the received directory
+static QString safeRelativePath(const QString &path)
+{
+    QString clean = QDir::cleanPath(path);
+    if (clean.isEmpty() || clean == "." || QDir::isAbsolutePath(clean) || clean == ".." || clean.startsWith("../")) {
+        return QString();
+    }
+    return clean;
 }
 
 void Socket::corruptFrag(bool crpt)
@@ -192,122 +269,663 @@ QByteArray Socket::checksum(const QByteArray &arr)
     return intToArray(qChecksum(arr.data(), static_cast<uint>(arr.size())));
 }
 
+void Socket::sendPacket(const QByteArray &fragment, bool corrupt)
+{
+    // Whatever data fragment goes out next takes a held ACK along
+    const QByteArray data = packetType(fragment[0]) == packetType::data ? piggybackAck(fragment) : fragment;
+
+    // Handshakes stay readable with a checksum, everything after them is sealed once we have a key
+    QByteArray packet;
+    packetType type = packetType(data[0]);
+    if (m_aead.isReady() && type != packetType::handshake && type != packetType::shakeSyn) {
+        if (!m_aead.seal(data, m_sealed)) {
+            emit debugMessage("Sealing packet failed, dropping it ...");
+            qDebug() << "aead seal failed";
+            return;
+        }
+        packet = m_sealed;
+    } else {
+        packet = data;
+        packet.append(checksum(data));
+    }
+    if (corrupt) {
+        packet[3] = 'x';
+    }
+    bool queued = false;
+#ifdef UDPCOMM_IO_URING
+    queued = m_io && m_io->send(packet);
+#endif
+    if (!queued) {
+        m_udpSocket->write(packet);
+    }
+    // Any outgoing packet proves we're alive, keepalive is only sent on an idle link
+    if (m_connectionTimer.isActive()) {
+        m_keepaliveTimer.start();
+    }
+}
+
+void Socket::queueAck(quint8 type, quint32 value)
+{
+    // A newer data ACK is cumulative and replaces the pending one, anything else goes out first
+    if (!m_pendingAck.isEmpty() && static_cast<quint8>(m_pendingAck[0]) != type) {
+        flushAck();
+    }
+    m_pendingAck.clear();
+    m_pendingAck.append(static_cast<char>(type));
+    m_pendingAck.append(intToArray(value));
+
+    // Held back for at most ACK_DELAY_MS, and only when one of our own fragments is
+    // about to go out to carry it: while the datagram being processed still carries
+    // an ACK for our data, or on the connecting side while our own block is in flight.
+    // The accepting side never waits on its data, so both ends can't hold at once.
+    const bool sending = m_blockToSend * m_ackBlock < static_cast<quint32>(m_fragsToSend.size());
+    if (m_holdAck || (sending && !m_server)) {
+        if (!m_ackDelayTimer.isActive()) {
+            m_ackDelayTimer.start();
+        }
+        return;
+    }
+    flushAck();
+}
+
+void Socket::on_ackDelay_timeout()
+{
+    qDebug() << "on_ackDelay_timeout, nothing to piggyback on";
+    flushAck();
+}
+
+void Socket::flushAck()
+{
+    m_ackDelayTimer.stop();
+    if (m_pendingAck.isEmpty()) {
+        return;
+    }
+    QByteArray ack;
+    ack.append(static_cast<char>(packetType::ack));
+    ack.append(m_pendingAck);
+    m_pendingAck.clear();
+    sendPacket(ack);
+}
+
+QByteArray Socket::piggybackAck(const QByteArray &fragment)
+{
+    if (m_pendingAck.isEmpty()) {
+        return fragment;
+    }
+    m_ackDelayTimer.stop();
+    QByteArray data = fragment;
+    data[0] = static_cast<char>(static_cast<int>(packetType::data) | static_cast<int>(packetType::ack));
+    data.append(m_pendingAck);
+    m_pendingAck.clear();
+    return data;
+}
+
+QString Socket::peerKey() const
+{
+    return m_udpSocket->peerAddress().toString() + ':' + QString::number(m_udpSocket->peerPort());
+}
+
+QByteArray Socket::handshakePacket() const
+{
+    QByteArray data;
+    data.append(static_cast<char>(packetType::handshake));
+    if (m_resumeTicket != 0) {
+        data.append(intToArray(m_resumeTicket));
+    }
+    if (!m_localPublic.isEmpty()) {
+        data.append(static_cast<char>(m_cipher));
+        data.append(m_localPublic);
+    }
+    return data;
+}
+
+quint32 Socket::issueTicket(const QHostAddress &address)
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    quint32 ticket = 0;
+    while (ticket == 0 || m_issuedTickets.contains(ticket)) {
+        ticket = QRandomGenerator::global()->generate();
+    }
+    m_issuedTickets.insert(ticket, SessionTicket{address, now + SESSION_TICKET_LIFETIME_MS, m_aead.key()});
+    // Every ticket lives equally long, so issue order is expiry order and one deadline covers them all
+    m_ticketExpiry.append(ticket);
+    if (!m_ticketTimer.isActive()) {
+        m_ticketTimer.setInterval(SESSION_TICKET_LIFETIME_MS);
+        m_ticketTimer.start();
+    }
+    return ticket;
+}
+
+void Socket::on_ticket_timeout()
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    while (!m_ticketExpiry.isEmpty()) {
+        auto it = m_issuedTickets.constFind(m_ticketExpiry.first());
+        if (it != m_issuedTickets.constEnd() && it->expires > now) {
+            m_ticketTimer.setInterval(static_cast<int>(it->expires - now));
+            m_ticketTimer.start();
+            return;
+        }
+        // Expired, or already redeemed
+        if (it != m_issuedTickets.constEnd()) {
+            m_issuedTickets.erase(it);
+        }
+        m_ticketExpiry.removeFirst();
+    }
+}
+
+bool Socket::redeemTicket(quint32 ticket, const QHostAddress &address, QByteArray &key)
+{
+    if (!m_issuedTickets.contains(ticket)) {
+        return false;
+    }
+    // Tickets are single use, a resumed session always gets a fresh one
+    SessionTicket session = m_issuedTickets.take(ticket);
+    if (session.expires < QDateTime::currentMSecsSinceEpoch() || !session.address.isEqual(address)) {
+        return false;
+    }
+    key = session.key.isEmpty() ? QByteArray() : Aead::expandKey(session.key, intToArray(ticket));
+    return true;
+}
+
 void Socket::sendFile(const QString &filePath)
 {
+    QString fileName = QFileInfo(filePath).fileName();
+    emit debugMessage("Will send file: " + filePath);
+
+#ifdef UDPCOMM_IO_URING
+    // Read runs on the ring, INIT goes out from on_fileRead once the file is in memory
+    if (m_io) {
+        int slot = m_io->openFile(filePath, false);
+        if (slot >= 0) {
+            m_readNames.insert(slot, fileName);
+            m_io->readAll(slot);
+            return;
+        }
+    }
+#endif
     QFile fileToSend(filePath);
     fileToSend.open(QIODevice::ReadOnly);
-    QString fileName = QFileInfo(filePath).fileName();
-    fileName.truncate(42);
     qDebug() << "sending file: " << fileName << "is open: " << fileToSend.isOpen();
-    emit debugMessage("Will send file: " + fileToSend.fileName());
 
     QByteArray fileByteArr(fileToSend.readAll());
     fileToSend.close();
+    startTransfer(fileByteArr, fileName.toUtf8());
+}
 
-    quint32 packetsToSend = static_cast<quint32>(fileByteArr.size() / m_fragSize);
-    if (fileByteArr.size() % m_fragSize != 0) ++packetsToSend;
-    qDebug() << "packetsToSend" << packetsToSend;
+void Socket::sendDirectory(const QString &dirPath)
+{
+    if (m_dirWatcher->isRunning()) {
+        emit debugMessage("Still reading the previous directory, try again later.");
+        return;
+    }
+    QDir root(dirPath);
+    m_dirName = root.dirName();
+    m_dirPaths.clear();
+    m_dirModes.clear();
+
+    QStringList absolutePaths;
+    qint64 streamSize = 4;
+    QDirIterator it(dirPath, QDir::Files | QDir::Hidden | QDir::NoSymLinks, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        absolutePaths.append(it.next());
+        m_dirPaths.append(root.relativeFilePath(absolutePaths.last()));
+        m_dirModes.append(static_cast<quint16>(it.fileInfo().permissions()));
+        streamSize += 2 + m_dirPaths.last().toUtf8().size() + 6 + it.fileInfo().size();
+    }
+    if (streamSize > MAX_STREAM_SIZE) {
+        emit debugMessage("Directory " + dirPath + " packs into " + QString::number(streamSize) + " bytes, more than the "
+                          + QString::number(MAX_STREAM_SIZE) + " one transfer can carry. Not sent.");
+        return;
+    }
+    emit debugMessage("Will send directory: " + dirPath + " (" + QString::number(m_dirPaths.size()) + " files)");
 
-    QByteArray initData;
-    initData.append(static_cast<char>(packetType::init));
-    initData.append(intToArray(packetsToSend));
-    initData.append(ACK_CONFIRM);
-    initData.append(fileName.toLatin1());
-    initData.append(checksum(initData));
+    // Files are read ahead on the thread pool, the stream is packed once all of them are in
+    m_dirWatcher->setFuture(QtConcurrent::mapped(absolutePaths, readWholeFile));
+}
 
-    m_initToSend = initData;
-    m_udpSocket->write(initData);
-    m_dataToSend.append(fileByteArr);
-    m_retryInitTimer->start();
+void Socket::on_directoryRead()
+{
+    // Stream: [count 4] count * [path length 2][path][size 4][mode 2], then all contents back to back
+    const QList<FileData> contents = m_dirWatcher->future().results();
+    QByteArray manifest;
+    manifest.append(intToArray(static_cast<quint32>(contents.size())));
+    qint64 contentSize = 0;
+    for (int i = 0; i < contents.size(); ++i) {
+        if (!contents[i].ok) {
+            emit debugMessage("Couldn't read " + m_dirPaths[i] + ", directory not sent.");
+            return;
+        }
+        QByteArray path = m_dirPaths[i].toUtf8();
+        manifest.append(intToArray(static_cast<quint16>(path.size())));
+        manifest.append(path);
+        manifest.append(intToArray(static_cast<quint32>(contents[i].content.size())));
+        manifest.append(intToArray(m_dirModes[i]));
+        contentSize += contents[i].content.size();
+    }
+    // Files may have grown since they were listed
+    if (manifest.size() + contentSize > MAX_STREAM_SIZE) {
+        emit debugMessage("Directory grew past " + QString::number(MAX_STREAM_SIZE) + " bytes while reading, not sent.");
+        return;
+    }
+
+    QByteArray stream;
+    stream.reserve(static_cast<int>(manifest.size() + contentSize));
+    stream.append(manifest);
+    for (const FileData &file: contents) {
+        stream.append(file.content);
+    }
+    emit debugMessage("Packed " + QString::number(contents.size()) + " files into " + QString::number(stream.size()) + " bytes.");
+
+    QByteArray name(1, static_cast<char>(initType::directory));
+    name.append(m_dirName.toUtf8());
+    startTransfer(stream, name);
+}
+
+void Socket::on_fileRead(int slot, const QByteArray &data)
+{
+#ifdef UDPCOMM_IO_URING
+    m_io->closeFile(slot);
+#endif
+    qDebug() << "file read finished, size:" << data.size();
+    startTransfer(data, m_readNames.take(slot).toUtf8());
+}
+
+void Socket::on_fileFailed(int slot, const QString &msg)
+{
+    qDebug() << "file I/O failed on slot" << slot << msg;
+    emit debugMessage(msg);
+#ifdef UDPCOMM_IO_URING
+    if (m_readNames.contains(slot)) {
+        // Nothing was announced to the peer yet, dropping the read is the whole abort
+        emit debugMessage("Reading " + m_readNames.take(slot) + " failed, file not sent.");
+        m_io->closeFile(slot);
+    } else if (slot == m_fileSlot) {
+        // The rest of the transfer still gets ACKed, but nothing more goes to disk
+        emit debugMessage("Writing received file failed, discarding the rest of it.");
+        m_fileFailed = true;
+    }
+#endif
 }
 
 void Socket::sendMessage(const QString &msg)
 {
-    QByteArray msgArr(msg.toLatin1());
-    QByteArray initData;
-    initData.reserve(9);
+    startTransfer(msg.toLatin1(), QByteArray(1, static_cast<char>(initType::message)));
+}
+
+// Fragments needed for a payload plus the tree hash at the end of the last one.
+// The hash takes TREEHASH_SIZE bytes of that fragment's budget, when the
+// payload leaves less than that room it gets a fragment of its own.
+static quint32 fragmentCount(int size, int fragSize)
+{
+    quint32 count = static_cast<quint32>((static_cast<qint64>(size) + fragSize - 1) / fragSize);
+    const qint64 lastLen = size - static_cast<qint64>(count > 0 ? count - 1 : 0) * fragSize;
+    if (count == 0 || lastLen + TREEHASH_SIZE > fragSize) {
+        ++count;
+    }
+    return count;
+}
 
-    quint32 packetsToSend = static_cast<quint32>(msgArr.size() / m_fragSize);
-    if (msgArr.size() % m_fragSize != 0) ++packetsToSend;
+void Socket::startTransfer(const QByteArray &payload, const QByteArray &name)
+{
+    // The count in the INIT and the split in prepareDataPayload must agree, even if setFragSize runs in between
+    m_sendFragSize = m_fragSize;
+    quint32 packetsToSend = fragmentCount(payload.size(), m_sendFragSize);
     qDebug() << "packetsToSend" << packetsToSend;
 
+    QByteArray initData;
     initData.append(static_cast<char>(packetType::init));
     initData.append(intToArray(packetsToSend));
-    initData.append(ACK_CONFIRM);
-    initData.append(1);
-    initData.append(checksum(initData));
+    initData.append(static_cast<char>(m_ackEvery));
+    initData.append(name);
 
     m_initToSend = initData;
-    m_udpSocket->write(initData);
-    m_dataToSend.append(msgArr);
-    m_retryInitTimer->start();
+    sendPacket(initData);
+    m_dataToSend.append(payload);
+    m_retryInitTimer.start();
+}
+
+void Socket::openReceivedFile(const QString &fileName)
+{
+#ifdef UDPCOMM_IO_URING
+    if (m_io) {
+        m_fileSlot = m_io->openFile(fileName, true);
+        m_fileOffset = 0;
+        m_fileFailed = false;
+        if (m_fileSlot >= 0) {
+            emit debugMessage("init: Receiving file: " + fileName);
+            return;
+        }
+    }
+#endif
+    m_file = new QFile(fileName);
+    m_file->open(QIODevice::WriteOnly);
+    qDebug() << "is file open: " << m_file->isOpen();
+    emit debugMessage("init: Receiving file: " + m_file->fileName());
+}
+
+void Socket::openReceivedDirectory(const QString &dirName)
+{
+    // Only the last component of the sender's name is used, the tree always lands under it
+    m_dirReceiveRoot = QFileInfo(dirName).fileName();
+    if (m_dirReceiveRoot.isEmpty() || m_dirReceiveRoot == "..") {
+        m_dirReceiveRoot = "received";
+    }
+    QDir().mkpath(m_dirReceiveRoot);
+    m_dirStream.clear();
+    m_dirEntries.clear();
+    m_dirCreated.clear();
+    m_dirEntryCount = -1;
+    m_dirFileIndex = 0;
+    m_dirWritten = 0;
+    m_dirComplete = false;
+    emit debugMessage("init: Receiving directory: " + m_dirReceiveRoot);
+}
+
+void Socket::consumeDirectoryStream()
+{
+    int pos = 0;
+    if (m_dirEntryCount < 0) {
+        if (m_dirStream.size() < 4) {
+            return;
+        }
+        m_dirEntryCount = arrToInt(m_dirStream.mid(0, 4));
+        pos = 4;
+    }
+
+    while (m_dirEntries.size() < m_dirEntryCount && m_dirStream.size() - pos >= 2) {
+        int pathLen = arrToCheck(m_dirStream.mid(pos, 2));
+        if (m_dirStream.size() - pos < 2 + pathLen + 6) {
+            break;
+        }
+        DirEntry entry;
+        entry.path = safeRelativePath(QString::fromUtf8(m_dirStream.mid(pos + 2, pathLen)));
+        entry.size = arrToInt(m_dirStream.mid(pos + 2 + pathLen, 4));
+        entry.mode = arrToCheck(m_dirStream.mid(pos + 6 + pathLen, 2));
+        m_dirEntries.append(entry);
+        pos += 2 + pathLen + 6;
+    }
+
+    // Every file whose bytes are complete is handed to the thread pool, the event loop never waits on disk
+    while (m_dirEntries.size() == m_dirEntryCount && m_dirFileIndex < m_dirEntries.size()) {
+        const DirEntry &entry = m_dirEntries[m_dirFileIndex];
+        if (static_cast<quint32>(m_dirStream.size() - pos) < entry.size) {
+            break;
+        }
+        QByteArray content = m_dirStream.mid(pos, static_cast<int>(entry.size));
+        pos += static_cast<int>(entry.size);
+        ++m_dirFileIndex;
+        if (entry.path.isEmpty()) {
+            emit debugMessage("Skipping file with unsafe path in directory manifest.");
+            continue;
+        }
+
+        QString target = m_dirReceiveRoot + '/' + entry.path;
+        QString parent = QFileInfo(target).path();
+        if (!m_dirCreated.contains(parent)) {
+            QDir().mkpath(parent);
+            m_dirCreated.insert(parent);
+        }
+        QFutureWatcher<WriteResult> *watcher = new QFutureWatcher<WriteResult>(this);
+        connect(watcher, SIGNAL(finished()), this, SLOT(on_directoryFileWritten()));
+        m_dirWrites.insert(watcher, entry.path);
+        watcher->setFuture(QtConcurrent::run(writeWholeFile, target, content, entry.mode));
+    }
+    m_dirStream.remove(0, pos);
+}
+
+void Socket::on_directoryFileWritten()
+{
+    QFutureWatcher<WriteResult> *watcher = static_cast<QFutureWatcher<WriteResult> *>(sender());
+    const QString path = m_dirWrites.take(watcher);
+    switch (watcher->result()) {
+    case WriteResult::modeFailed:
+        emit debugMessage("Couldn't set permissions of " + m_dirReceiveRoot + '/' + path);
+        ++m_dirWritten;
+        break;
+    case WriteResult::written:
+        ++m_dirWritten;
+        break;
+    case WriteResult::failed:
+        emit debugMessage("Couldn't write " + m_dirReceiveRoot + '/' + path);
+        break;
+    }
+    watcher->deleteLater();
+    finishReceivedDirectory();
+}
+
+void Socket::finishReceivedDirectory()
+{
+    // Reported once the last byte is in and every write has landed
+    if (!m_dirComplete || !m_dirWrites.isEmpty()) {
+        return;
+    }
+    m_dirComplete = false;
+    const qint64 expected = qMax<qint64>(m_dirEntryCount, 0);
+    if (m_dirWritten == expected) {
+        emit debugMessage("Received directory " + m_dirReceiveRoot + " with " + QString::number(m_dirWritten) + " files.");
+    } else {
+        emit debugMessage("Received directory " + m_dirReceiveRoot + " INCOMPLETE, only " + QString::number(m_dirWritten)
+                          + " of " + QString::number(expected) + " files written.");
+    }
+    m_dirEntries.clear();
+}
+
+void Socket::writeReceivedFile(const QByteArray &data)
+{
+#ifdef UDPCOMM_IO_URING
+    // Queued on the ring, the ACK for this block doesn't wait for the disk
+    if (m_fileSlot >= 0) {
+        if (m_fileFailed) {
+            return;
+        }
+        m_io->write(m_fileSlot, m_fileOffset, data);
+        m_fileOffset += data.size();
+        return;
+    }
+#endif
+    m_file->write(data);
+}
+
+void Socket::closeReceivedFile()
+{
+#ifdef UDPCOMM_IO_URING
+    if (m_fileSlot >= 0) {
+        if (m_fileFailed) {
+            emit debugMessage("Received file is incomplete on disk, a write failed.");
+        }
+        m_io->closeFile(m_fileSlot);
+        m_fileSlot = -1;
+        return;
+    }
+#endif
+    delete m_file;
+    m_file = nullptr;
 }
 
 void Socket::prepareDataPayload()
 {
     qDebug() << "sendDataPayload";
-    QByteArray wholeData = m_dataToSend.takeFirst();
-    qDebug() << "data size to send:" << wholeData.size();
+    m_sendPayload = m_dataToSend.takeFirst();
+    qDebug() << "data size to send:" << m_sendPayload.size();
     QVector<QByteArray> splitData;
 
-    qint8 x = 0;
-    for (qint32 i = 0; i < wholeData.size(); ++x, i += m_fragSize) {
-        if (x == ACK_CONFIRM) x = 0;
+    // The last fragment may carry no payload at all, only the hash added by hashOutgoingBlock
+    const quint32 count = fragmentCount(m_sendPayload.size(), m_sendFragSize);
+    for (quint32 n = 0; n < count; ++n) {
         QByteArray fragment;
         fragment.append(static_cast<char>(packetType::data));
-        fragment.append(x);
-        fragment.append(wholeData.mid(i, m_fragSize));
-        fragment.append(checksum(fragment));
+        fragment.append(static_cast<char>(n / m_ackBlock));
+        fragment.append(static_cast<char>(n % m_ackBlock));
+        const qint64 offset = qMin<qint64>(static_cast<qint64>(n) * m_sendFragSize, m_sendPayload.size());
+        fragment.append(m_sendPayload.mid(static_cast<int>(offset), m_sendFragSize));
         splitData.append(fragment);
     }
 
     m_tempSendCurrupt = m_sendCurrupt;
     m_fragsToSend = splitData;
     m_blockToSend = 0;
+    m_blocksHashed = 0;
+    m_sendHash.reset();
     qDebug() << "before on_timeout";
     on_retryData_timeout();
 }
 
+void Socket::hashOutgoingBlock()
+{
+    const int first = static_cast<int>(m_blocksHashed * m_ackBlock);
+    const int last = qMin(first + m_ackBlock, m_fragsToSend.size());
+    if (first >= last) {
+        return;
+    }
+    // The block goes in as one range, so a large ACK interval lets TreeHash spread it over the thread pool
+    const qint64 begin = qMin<qint64>(static_cast<qint64>(first) * m_sendFragSize, m_sendPayload.size());
+    const qint64 end = qMin<qint64>(static_cast<qint64>(last) * m_sendFragSize, m_sendPayload.size());
+    m_sendHash.addData(m_sendPayload.constData() + begin, static_cast<int>(end - begin));
+    ++m_blocksHashed;
+
+    // Last fragment of the transfer carries the tree hash: [payload][hash 32]
+    if (last == m_fragsToSend.size()) {
+        QByteArray digest = m_sendHash.result();
+        m_fragsToSend.last().append(digest);
+        m_sendPayload.clear();
+        emit debugMessage("Tree hash of sent data: " + digest.toHex());
+    }
+}
+
 void Socket::setFragSize(int fragSize)
 {
     if (fragSize > MAX_FRAG_SIZE) {
-        emit debugMessage("Maximum fragment size is 1446, fragment size not set!");
+        emit debugMessage("Maximum fragment size is " + QString::number(MAX_FRAG_SIZE) + ", fragment size not set!");
+        return;
+    }
+    // The last fragment has to fit the tree hash
+    if (fragSize < TREEHASH_SIZE) {
+        emit debugMessage("Minimum fragment size is " + QString::number(TREEHASH_SIZE) + ", fragment size not set!");
         return;
     }
     m_fragSize = fragSize;
     emit debugMessage("Fragment size set to: " + QString::number(m_fragSize));
 }
 
+void Socket::setPreSharedKey(const QString &psk)
+{
+    m_psk = psk.toUtf8();
+    emit debugMessage(m_psk.isEmpty() ? "Pre-shared key cleared." : "Pre-shared key set, it's mixed into every session key.");
+}
+
+void Socket::warnIfNoPsk()
+{
+    if (m_psk.isEmpty()) {
+        qDebug() << "session keyed without pre-shared key";
+        emit debugMessage("WARNING: session keyed without a pre-shared key, the peer isn't authenticated and a man in the middle can't be ruled out.");
+    }
+}
+
+void Socket::setCipher(Aead::Cipher cipher)
+{
+    m_cipher = cipher;
+    emit debugMessage(cipher == Aead::Cipher::chaCha20Poly1305 ? "Proposing ChaCha20-Poly1305." : "Proposing AES-256-GCM.");
+}
+
+void Socket::setAckEvery(int ackEvery)
+{
+    if (ackEvery < 1 || ackEvery > 255) {
+        emit debugMessage("ACK interval must be between 1 and 255 fragments, not set!");
+        return;
+    }
+    m_ackEvery = static_cast<quint8>(ackEvery);
+    emit debugMessage("Proposing ACK every " + QString::number(m_ackEvery) + " fragments.");
+}
+
 void Socket::on_connected()
 {
     qDebug() << "on_connected" << m_server;
+#ifdef UDPCOMM_IO_URING
+    if (m_io) {
+        m_io->setSocket(m_udpSocket->socketDescriptor());
+    }
+#endif
     if (m_server) {
-        QByteArray data;
-        data.append(static_cast<char>(packetType::shakeSyn));
-        data.append(checksum(data));
-        m_udpSocket->write(data);
-        m_retrySynTimer->start();
+        answerHandshake();
     } else {
-        emit debugMessage("Socket connected. Trying to establish connetion with server.");
-        QByteArray data;
-        data.append(static_cast<char>(packetType::handshake));
-        data.append(checksum(data));
-        m_udpSocket->write(data);
-        m_retryHandshakeTimer->start();
+        ResumeTicket resume = m_resumeTickets.take(peerKey());
+        m_resumeTicket = resume.ticket;
+        m_localPublic = m_aead.generateKeyPair();
+        if (m_resumeTicket != 0) {
+            emit debugMessage("Socket connected. Resuming session with stored ticket.");
+            // 0-RTT, the resumed key is usable before the server answers
+            if (!resume.key.isEmpty()) {
+                m_aead.setKey(Aead::expandKey(resume.key, intToArray(m_resumeTicket)), m_cipher, false);
+            }
+        } else {
+            emit debugMessage("Socket connected. Trying to establish connetion with server.");
+        }
+        sendPacket(handshakePacket());
+        m_retryHandshakeTimer.start();
     }
 }
 
+void Socket::answerHandshake()
+{
+    // Handshake body: [type][ticket 4, when resuming][cipher][public key 32, when encrypting]
+    const QByteArray &handshake = m_handshakeToAnswer;
+    const bool hasKey = handshake.size() >= 2 + AEAD_KEY_SIZE;
+    const Aead::Cipher cipher = hasKey ? Aead::Cipher(handshake[handshake.size() - 1 - AEAD_KEY_SIZE]) : m_cipher;
+
+    QByteArray data;
+    if (m_resumeAccepted) {
+        // Known peer, skip shakeSyn round trip and hand out the next ticket right away
+        emit debugMessage("Session resumed from ticket.");
+        m_resumeAccepted = false;
+        if (hasKey && !m_resumeKey.isEmpty()) {
+            m_aead.setKey(m_resumeKey, cipher, true);
+        } else {
+            m_aead.reset();
+        }
+        data.append(static_cast<char>(packetType::ack));
+        data.append(static_cast<char>(ackType::handshake));
+        data.append(intToArray(issueTicket(m_udpSocket->peerAddress())));
+        m_answerToSend = data;
+        m_retrySynTimer.stop();
+        m_connectionTimer.start();
+        sendPacket(data);
+        return;
+    }
+
+    QByteArray key;
+    if (hasKey) {
+        QByteArray peerPublic = handshake.right(AEAD_KEY_SIZE);
+        m_localPublic = m_aead.generateKeyPair();
+        key = m_aead.deriveKey(peerPublic, m_psk + peerPublic + m_localPublic);
+    }
+    if (key.isEmpty()) {
+        m_aead.reset();
+        m_localPublic.clear();
+    } else {
+        m_aead.setKey(key, cipher, true);
+        warnIfNoPsk();
+    }
+
+    data.append(static_cast<char>(packetType::shakeSyn));
+    data.append(intToArray(issueTicket(m_udpSocket->peerAddress())));
+    if (m_aead.isReady()) {
+        data.append(static_cast<char>(cipher));
+        data.append(m_localPublic);
+    }
+    m_answerToSend = data;
+    sendPacket(data);
+    m_retrySynTimer.start();
+}
+
 void Socket::on_retryHandshake_timeout()
 {
     qDebug() << "on_retryHandshake_timeout" << m_server;
     if (++m_retryCount > REPEAT_LIMIT) {
         return;
     }
-    QByteArray data;
-    data.append(static_cast<char>(packetType::handshake));
-    data.append(checksum(data));
-    m_udpSocket->write(data);
-    m_retryHandshakeTimer->start();
+    sendPacket(handshakePacket());
+    m_retryHandshakeTimer.start();
 }
 
 void Socket::on_retrySyn_timeout()
@@ -315,11 +933,8 @@ void Socket::on_retrySyn_timeout()
     if (++m_retrySynCount > REPEAT_LIMIT) {
         return;
     }
-    QByteArray data;
-    data.append(static_cast<char>(packetType::shakeSyn));
-    data.append(checksum(data));
-    m_udpSocket->write(data);
-    m_retrySynTimer->start();
+    sendPacket(m_answerToSend);
+    m_retrySynTimer.start();
 }
 
 void Socket::on_retryInit_timeout()
@@ -327,8 +942,8 @@ void Socket::on_retryInit_timeout()
     if (++m_retryInitCount > REPEAT_LIMIT) {
         return;
     }
-    m_udpSocket->write(m_initToSend);
-    m_retryInitTimer->start();
+    sendPacket(m_initToSend);
+    m_retryInitTimer.start();
 }
 
 void Socket::on_retryData_timeout()
@@ -338,20 +953,23 @@ void Socket::on_retryData_timeout()
         qDebug() << " data retryCount reached";
         return;
     }
-    QVector<QByteArray> fragsToSend = m_fragsToSend.mid(m_blockToSend * ACK_CONFIRM, ACK_CONFIRM);
+    // Hashed the first time a block goes out, retransmits don't feed the hash again
+    if (m_blockToSend == m_blocksHashed) {
+        hashOutgoingBlock();
+    }
+    QVector<QByteArray> fragsToSend = m_fragsToSend.mid(static_cast<int>(m_blockToSend * m_ackBlock), m_ackBlock);
     if (fragsToSend.isEmpty()) {
         qDebug() << "frags to send empty";
+        // Our transfer is done, nothing left to carry a held ACK
+        flushAck();
         return;
     }
 
-    for (QByteArray &data: fragsToSend) {
-        if (m_tempSendCurrupt) {
-            data[2] = 'x';
-            m_tempSendCurrupt = false;
-        }
-        m_udpSocket->write(data);
+    for (const QByteArray &data: fragsToSend) {
+        sendPacket(data, m_tempSendCurrupt);
+        m_tempSendCurrupt = false;
     }
-    m_retryDataTimer->start();
+    m_retryDataTimer.start();
 }
 
 void Socket::on_data_timeout()
@@ -364,26 +982,38 @@ void Socket::on_disconnected()
 {
     qDebug() << "on_disconnected" << m_server;
     emit debugMessage("Socket disconnected.");
-    m_retryHandshakeTimer->stop();
-    m_retrySynTimer->stop();
-    m_connectionTimer->stop();
-    m_handshakeTimer->stop();
-    m_retryDataTimer->stop();
-    m_retryInitTimer->stop();
-    m_dataTimer->stop();
+#ifdef UDPCOMM_IO_URING
+    if (m_io) {
+        m_io->setSocket(-1);
+    }
+#endif
+    m_retryHandshakeTimer.stop();
+    m_retrySynTimer.stop();
+    m_connectionTimer.stop();
+    m_keepaliveTimer.stop();
+    m_retryDataTimer.stop();
+    m_retryInitTimer.stop();
+    m_dataTimer.stop();
+    m_ackDelayTimer.stop();
+    m_pendingAck.clear();
     m_retryCount = 0;
     m_retrySynCount = 0;
     m_retryDataCount = 0;
     m_retryInitCount = 0;
+    m_resumeTicket = 0;
+    m_resumeAccepted = false;
+    m_resumeKey.clear();
+    m_aead.reset();
+    m_localPublic.clear();
+    m_answerToSend.clear();
+    m_handshakeToAnswer.clear();
 }
 
-void Socket::on_handshake_timeout()
+void Socket::on_keepalive_timeout()
 {
     QByteArray data;
-    data.append(static_cast<char>(packetType::handshake));
-    data.append(checksum(data));
-    m_udpSocket->write(data);
-    m_retryHandshakeTimer->start();
+    data.append(static_cast<char>(packetType::keepalive));
+    sendPacket(data);
 }
 
 void Socket::on_connection_timeout()
@@ -393,44 +1023,65 @@ void Socket::on_connection_timeout()
     disconnect();
 }
 
-void Socket::on_got_handshake(const QNetworkDatagram &datagram)
+void Socket::on_got_handshake(const QNetworkDatagram &datagram, const QByteArray &recData)
 {
     qDebug() << "on_got_handshake" << m_server;
-    if (m_connectionTimer->isActive()) {
+    if (m_connectionTimer.isActive()) {
         emit debugMessage("Got Handshake, resetting connection timer.");
     } else {
         emit debugMessage("Got Handshake, starting connection timer.");
     }
+    // Retransmitted handshake, answering it again must not re-key the session
+    if (recData == m_handshakeToAnswer && !m_answerToSend.isEmpty()) {
+        sendPacket(m_answerToSend);
+        return;
+    }
+    m_handshakeToAnswer = recData;
+    m_resumeAccepted = (recData.size() == 5 || recData.size() == 6 + AEAD_KEY_SIZE)
+            && redeemTicket(arrToInt(recData.mid(1, 4)), datagram.senderAddress(), m_resumeKey);
     if (m_udpSocket->state() != QAbstractSocket::ConnectedState) {
             m_server = true;
             m_udpSocket->connectToHost(datagram.senderAddress(), quint16(datagram.senderPort()));
             return;
     }
-    QByteArray data;
-    data.append(static_cast<char>(packetType::shakeSyn));
-    data.append(checksum(data));
-    m_udpSocket->write(data);
-    m_retrySynTimer->start();
+    answerHandshake();
 }
 
 void Socket::on_got_synHandshake(const QByteArray &recData)
 {
-    if (m_connectionTimer->isActive()) {
+    if (m_connectionTimer.isActive()) {
         emit debugMessage("Got Handshake, resetting connection timer.");
     } else {
         emit debugMessage("Got Handshake, starting connection timer.");
     }
-    QByteArray chsum = checksum(recData.mid(1, 2));
+    // Retransmitted shakeSyn, our ACK got lost, answering it again must not re-key the session
+    if (recData == m_handshakeToAnswer && !m_answerToSend.isEmpty()) {
+        sendPacket(m_answerToSend);
+        return;
+    }
+    m_handshakeToAnswer = recData;
+    // shakeSyn body: [type][ticket 4][cipher][public key 32, when encrypting]
+    if (recData.size() == 6 + AEAD_KEY_SIZE && !m_localPublic.isEmpty()) {
+        QByteArray peerPublic = recData.right(AEAD_KEY_SIZE);
+        QByteArray key = m_aead.deriveKey(peerPublic, m_psk + m_localPublic + peerPublic);
+        m_aead.setKey(key, Aead::Cipher(recData[5]), false);
+        emit debugMessage("Session key agreed, packets are encrypted from now on.");
+        warnIfNoPsk();
+    } else {
+        m_aead.reset();
+    }
+    if (recData.size() >= 5) {
+        m_resumeTickets.insert(peerKey(), ResumeTicket{arrToInt(recData.mid(1, 4)), m_aead.key()});
+    }
+    m_resumeTicket = 0;
 
-    m_retryHandshakeTimer->stop();
+    m_retryHandshakeTimer.stop();
+    m_connectionTimer.start();
     QByteArray data;
     data.append(static_cast<char>(packetType::ack));
     data.append(static_cast<char>(ackType::handshake));
-    data.append(checksum(data));
-    m_udpSocket->write(data);
-
-    m_connectionTimer->start();
-    m_handshakeTimer->start();
+    m_answerToSend = data;
+    sendPacket(data);
 }
 
 void Socket::on_got_ack(const QByteArray &recData)
@@ -440,25 +1091,42 @@ void Socket::on_got_ack(const QByteArray &recData)
     ackType type = ackType(recData[1]);
 
     switch (type) {
-    case ackType::data:
-        qDebug() << "ack_data";
-        emit debugMessage("Got ACK on DATA.");
-        m_retryDataTimer->stop();
+    case ackType::data: {
+        // Cumulative, stale or duplicate ACKs can't move the window backwards or skip a block
+        quint32 acked = arrToInt(recData.mid(2, 4));
+        qDebug() << "ack_data" << acked;
+        if (acked <= m_blockToSend * m_ackBlock) {
+            break;
+        }
+        emit debugMessage("Got ACK on DATA, " + QString::number(acked) + " fragments delivered.");
+        m_retryDataTimer.stop();
         m_retryDataCount = 0;
-        ++m_blockToSend;
+        m_blockToSend = (acked + m_ackBlock - 1) / m_ackBlock;
         on_retryData_timeout();
         break;
+    }
     case ackType::init:
         qDebug() << "ack_init";
-        emit debugMessage("Got ACK on INIT.");
-        m_retryInitTimer->stop();
+        if (!m_retryInitTimer.isActive()) {
+            break;
+        }
+        m_ackBlock = qMax<quint8>(1, static_cast<quint8>(arrToInt(recData.mid(2, 4))));
+        emit debugMessage("Got ACK on INIT, ACK every " + QString::number(m_ackBlock) + " fragments.");
+        m_retryInitTimer.stop();
         prepareDataPayload();
         break;
     case ackType::handshake:
         qDebug() << "ack_handshake";
         emit debugMessage("Got ACK on Handshake.");
-        m_retrySynTimer->stop();
-        m_connectionTimer->start();
+        m_retrySynTimer.stop();
+        m_retryHandshakeTimer.stop();
+        if (recData.size() == 6) {
+            emit debugMessage("Session resumed, got new ticket.");
+            m_resumeTickets.insert(peerKey(), ResumeTicket{arrToInt(recData.mid(2, 4)), m_aead.key()});
+            m_resumeTicket = 0;
+        }
+        m_connectionTimer.start();
+        m_keepaliveTimer.start();
         break;
     }
 }
@@ -467,50 +1135,67 @@ void Socket::on_got_init(const QByteArray &data)
 {
     emit debugMessage("Got INIT");
     m_fragsToReceive = arrToInt(data.mid(1, 4));
-    m_ackLimit = static_cast<quint8>(data[5]);
+    // Peer proposes its ACK interval, we never take a larger block than we'd propose ourselves
+    m_ackLimit = qMax<quint8>(1, qMin(static_cast<quint8>(data[5]), m_ackEvery));
     qDebug() << "ack_limit: " << m_ackLimit;
     emit debugMessage("init: Send ACK every " + QString::number(m_ackLimit) + " fragments.");
     emit debugMessage("init: Total number of fragments to receive: " + QString::number(m_fragsToReceive));
 
-    QByteArray chsum = checksum(data.mid(0, data.size() - 2));
-
-    if (data[6] == 1) {
+    m_isFile = false;
+    m_isDirectory = false;
+    if (data[6] == static_cast<char>(initType::message)) {
         qDebug() << "is not file";
         emit debugMessage("init: Receiving text message.");
-        m_isFile = false;
+    } else if (data[6] == static_cast<char>(initType::directory)) {
+        m_isDirectory = true;
+        openReceivedDirectory(QString::fromUtf8(data.mid(7)));
     } else {
         m_isFile = true;
-        QString fileName = data.mid(6, data.size() - 8);
-        m_file = new QFile(fileName);
-        m_file->open(QIODevice::WriteOnly);
-        qDebug() << "is file open: " << m_file->isOpen();
-        emit debugMessage("init: Receiving file: " + m_file->fileName());
+        QString fileName = QFileInfo(QString::fromUtf8(data.mid(6))).fileName();
+        openReceivedFile(fileName);
     }
 
     m_receivedData.fill(QByteArray(), m_ackLimit);
     m_fragsReceived = 0;
     m_ackRecieved = 0;
+    m_blockExpected = 0;
+    m_receiveHash.reset();
+    m_expectedHash.clear();
 
-    QByteArray ack;
-    ack.append(static_cast<char>(packetType::ack));
-    ack.append(static_cast<char>(ackType::init));
-    ack.append(checksum(ack));
-    m_udpSocket->write(ack);
+    queueAck(static_cast<quint8>(ackType::init), m_ackLimit);
 }
 
 void Socket::on_got_data(const QByteArray &data)
 {
     emit debugMessage("Got data fragment.");
-    quint8 fragNum = static_cast<quint8>(data[1]);
-    qDebug() << "got frag #" << fragNum;
+    quint8 block = static_cast<quint8>(data[1]);
+    quint8 fragNum = static_cast<quint8>(data[2]);
+    qDebug() << "got frag #" << fragNum << "of block" << block;
+
+    // A piggybacked ACK is handled by processDatagram once the data is in
+    int trailer = 0;
+    if (static_cast<quint8>(data[0]) & static_cast<quint8>(packetType::ack)) {
+        trailer = 5;
+    }
 
-    QByteArray chsum = checksum(data.mid(0, data.size() - 2));
-    if (chsum != data.mid(data.size() - 2, 2)) {
-        qDebug() << "checksum doesn't match";
+    if (block != m_blockExpected) {
+        // Our ACK for this block got lost, the sender is repeating it
+        if (block == static_cast<quint8>(m_blockExpected - 1)) {
+            queueAck(static_cast<quint8>(ackType::data), m_fragsReceived);
+        }
+        return;
+    }
+    if (fragNum >= m_receivedData.size()) {
         return;
     }
 
-    QByteArray payLoad = data.mid(2, data.size() - 4);
+    // Sender's tree hash rides at the end of the transfer's last fragment
+    if (m_fragsReceived - m_ackRecieved + fragNum + 1 == m_fragsToReceive) {
+        m_expectedHash = data.mid(data.size() - trailer - TREEHASH_SIZE, TREEHASH_SIZE);
+        trailer += TREEHASH_SIZE;
+    }
+
+    QByteArray payLoad = data.mid(3, data.size() - 3 - trailer);
 
     ++m_fragsReceived;
     ++m_ackRecieved;
@@ -526,17 +1211,42 @@ void Socket::on_got_data(const QByteArray &data)
     }
     if (m_ackRecieved == m_ackLimit) {
 
-        for (const QByteArray &arr: m_receivedData) {
-            if (m_isFile) {
-                m_file->write(arr);
-            } else {
-                m_msg.append(arr);
-            }
+        // The block is joined first, so the disk sees one write per block instead of one per fragment
+        int blockSize = 0;
+        for (int i = 0; i < m_ackLimit; ++i) {
+            blockSize += m_receivedData[i].size();
+        }
+        QByteArray block;
+        block.reserve(blockSize);
+        for (int i = 0; i < m_ackLimit; ++i) {
+            block.append(m_receivedData[i]);
+        }
+        m_receiveHash.addData(block);
+        if (m_isFile) {
+            writeReceivedFile(block);
+        } else if (m_isDirectory) {
+            m_dirStream.append(block);
+        } else {
+            m_msg.append(block);
+        }
+        if (m_isDirectory) {
+            consumeDirectoryStream();
         }
 
         if (m_fragsReceived == m_fragsToReceive) {
+            QByteArray digest = m_receiveHash.result();
+            if (digest == m_expectedHash) {
+                emit debugMessage("Integrity check passed, tree hash: " + digest.toHex());
+            } else {
+                qDebug() << "tree hash mismatch" << digest.toHex() << m_expectedHash.toHex();
+                emit debugMessage("Integrity check FAILED, expected " + m_expectedHash.toHex() + " got " + digest.toHex());
+            }
             if (m_isFile) {
-                delete  m_file;
+                closeReceivedFile();
+            } else if (m_isDirectory) {
+                m_dirStream.clear();
+                m_dirComplete = true;
+                finishReceivedDirectory();
             } else {
                 emit receivedMessage(m_msg);
                 m_msg.clear();
@@ -545,16 +1255,13 @@ void Socket::on_got_data(const QByteArray &data)
 
         emit debugMessage("data: Received whole data block, sending ACK.");
         qDebug() << "reached ack limit, sending ack";
-        QByteArray ack;
-        ack.append(static_cast<char>(packetType::ack));
-        ack.append(static_cast<char>(ackType::data));
-        ack.append(checksum(ack));
-        m_udpSocket->write(ack);
+        queueAck(static_cast<quint8>(ackType::data), m_fragsReceived);
+        ++m_blockExpected;
         m_ackRecieved = 0;
-        m_dataTimer->stop();
+        m_dataTimer.stop();
         return;
     }
-    m_dataTimer->start();
+    m_dataTimer.start();
 }
 
 void Socket::on_got_error(const QByteArray &data)
@@ -562,24 +1269,78 @@ void Socket::on_got_error(const QByteArray &data)
     emit debugMessage("on_got_error");
 }
 
+void Socket::on_got_keepalive()
+{
+    qDebug() << "on_got_keepalive" << m_server;
+}
+
 void Socket::on_readyRead()
 {
     qDebug() << "on_readyRead";
-    QNetworkDatagram datagram(m_udpSocket->receiveDatagram());
+    // Drain everything that queued up since the last wakeup
+    while (m_udpSocket->hasPendingDatagrams()) {
+        processDatagram(m_udpSocket->receiveDatagram());
+    }
+}
 
+void Socket::processDatagram(const QNetworkDatagram &datagram)
+{
     QByteArray recData = datagram.data();
+    if (recData.size() < 3) {
+        return;
+    }
+
+    // Strip the tag or checksum trailer, handlers only ever see the packet body
+    if (static_cast<quint8>(recData[0]) & AEAD_SEALED_FLAG) {
+        if (!m_aead.open(recData, m_opened)) {
+            emit debugMessage("Got replayed packet or one that failed authentication, ignoring ...");
+            qDebug() << "aead replay or tag doesn't match";
+            return;
+        }
+        recData = m_opened;
+    } else {
+        QByteArray chsum = checksum(recData.mid(0, recData.size() - 2));
+        if (chsum != recData.mid(recData.size() - 2, 2)) {
+            emit debugMessage("Got corrupted fragment, ignoring ...");
+            qDebug() << "checksum doesn't match";
+            return;
+        }
+        recData.chop(2);
+        // A keyed session only answers an exact retransmit of the handshake it was keyed
+        // from, anything else in cleartext could re-key it under an attacker's key.
+        // The one exception is a client still waiting on a resume the server turned
+        // down, its 0-RTT key is replaced by the full handshake's shakeSyn.
+        const bool resumeDeclined = !m_server && m_resumeTicket != 0 && m_retryHandshakeTimer.isActive()
+                && packetType(recData[0]) == packetType::shakeSyn;
+        if (m_aead.isReady() && recData != m_handshakeToAnswer && !resumeDeclined) {
+            emit debugMessage("Got unencrypted packet on encrypted session, ignoring ...");
+            return;
+        }
+    }
     packetType type = packetType(static_cast<char>(recData[0]));
+    // Every valid packet from the peer keeps the session alive, except that a server
+    // doesn't count bare keepalives, so a peer that went idle is reclaimed after
+    // CONNECTION_TIMEOUT_MS and comes back later by resuming with its ticket
+    if (m_connectionTimer.isActive() && !(m_server && type == packetType::keepalive)) {
+        m_connectionTimer.start();
+    }
+    // Data fragment with an ACK riding along
+    if (static_cast<quint8>(recData[0]) == (static_cast<quint8>(packetType::data) | static_cast<quint8>(packetType::ack))) {
+        m_holdAck = true;
+        on_got_data(recData);
+        m_holdAck = false;
 
-    QByteArray chsum = checksum(recData.mid(0, recData.size() - 2));
-    if (chsum != recData.mid(recData.size() - 2, 2)) {
-        emit debugMessage("Got corrupted fragment, ignoring ...");
-        qDebug() << "checksum doesn't match";
+        QByteArray ack;
+        ack.append(static_cast<char>(packetType::ack));
+        ack.append(recData.right(5));
+        on_got_ack(ack);
+        flushAck();
         return;
     }
 
     switch (type) {
     case packetType::handshake:
-        on_got_handshake(datagram);
+        on_got_handshake(datagram, recData);
         break;
     case packetType::shakeSyn:
         on_got_synHandshake(recData);
@@ -596,5 +1357,8 @@ void Socket::on_readyRead()
     case packetType::error:
         on_got_error(recData);
         break;
+    case packetType::keepalive:
+        on_got_keepalive();
+        break;
     }
 }
@@ -3,13 +3,35 @@
 
 #include <QObject>
 #include <QUdpSocket>
-#include <QTimer>
 #include <QFile>
+#include <QHash>
+#include <QHostAddress>
+#include <QFutureWatcher>
+#include <QStringList>
+#include <QSet>
+#include "aead.h"
+#include "timerwheel.h"
+#include "treehash.h"
+
+class IoRing;
 
 class Socket : public QObject
 {
     Q_OBJECT
 public:
+    // One file of an outgoing directory as read on the thread pool
+    struct FileData {
+        QByteArray content;
+        bool ok;
+    };
+
+    // Outcome of writing one received directory file on the thread pool
+    enum class WriteResult {
+        written,
+        modeFailed,
+        failed
+    };
+
     explicit Socket(QObject *parent = nullptr);
 
     void bindSocket(const QString &port);
@@ -20,9 +42,13 @@ public:
 
     void sendMessage(const QString &);
     void sendFile(const QString &);
+    void sendDirectory(const QString &);
     void receiveMessage(const QString &);
 
     void setFragSize(int);
+    void setAckEvery(int);
+    void setPreSharedKey(const QString &);
+    void setCipher(Aead::Cipher);
     static QByteArray checksum(const QByteArray &);
     static QByteArray intToArray(quint32);
     static QByteArray intToArray(quint16);
@@ -35,21 +61,49 @@ private slots:
     void on_disconnected();
 
     void on_connection_timeout();
-    void on_handshake_timeout();
+    void on_keepalive_timeout();
     void on_retryHandshake_timeout();
     void on_retrySyn_timeout();
     void on_retryInit_timeout();
     void on_retryData_timeout();
     void on_data_timeout();
+    void on_ticket_timeout();
+    void on_ackDelay_timeout();
+    void on_fileRead(int slot, const QByteArray &data);
+    void on_fileFailed(int slot, const QString &msg);
+    void on_directoryRead();
+    void on_directoryFileWritten();
 
 protected:
-    void on_got_handshake(const QNetworkDatagram &datagram);
+    void on_got_handshake(const QNetworkDatagram &datagram, const QByteArray &data);
     void on_got_synHandshake(const QByteArray &data);
     void on_got_ack(const QByteArray &data);
     void on_got_init(const QByteArray &data);
     void on_got_data(const QByteArray &data);
     void on_got_error(const QByteArray &data);
+    void on_got_keepalive();
+    void processDatagram(const QNetworkDatagram &datagram);
     void prepareDataPayload();
+    void hashOutgoingBlock();
+    void startTransfer(const QByteArray &payload, const QByteArray &name);
+
+    void openReceivedFile(const QString &fileName);
+    void writeReceivedFile(const QByteArray &data);
+    void closeReceivedFile();
+    void openReceivedDirectory(const QString &dirName);
+    void consumeDirectoryStream();
+    void finishReceivedDirectory();
+
+    void sendPacket(const QByteArray &fragment, bool corrupt = false);
+    void queueAck(quint8 type, quint32 value);
+    void flushAck();
+    void warnIfNoPsk();
+    QByteArray piggybackAck(const QByteArray &fragment);
+    QByteArray handshakePacket() const;
+    void answerHandshake();
+    quint32 issueTicket(const QHostAddress &address);
+    bool redeemTicket(quint32 ticket, const QHostAddress &address, QByteArray &key);
+    QString peerKey() const;
 
 private:
     QUdpSocket *m_udpSocket;
@@ -57,30 +111,45 @@ private:
 
     QNetworkDatagram m_recDatagram();
 
-    QTimer *m_connectionTimer;
-    QTimer *m_handshakeTimer;
-    QTimer *m_retryHandshakeTimer;
-    QTimer *m_retrySynTimer;
-    QTimer *m_retryInitTimer;
-    QTimer *m_retryDataTimer;
-    QTimer *m_dataTimer;
+    WheelTimer m_connectionTimer;
+    WheelTimer m_keepaliveTimer;
+    WheelTimer m_retryHandshakeTimer;
+    WheelTimer m_retrySynTimer;
+    WheelTimer m_retryInitTimer;
+    WheelTimer m_retryDataTimer;
+    WheelTimer m_dataTimer;
+    WheelTimer m_ticketTimer;
+    WheelTimer m_ackDelayTimer;
 
     QVector<QByteArray> m_dataToSend;
     QVector<QByteArray> m_fragsToSend;
     QByteArray m_initToSend;
+    QByteArray m_answerToSend;
+    QByteArray m_handshakeToAnswer;
     QVector<QByteArray> m_receivedData;
 
     quint8 m_retryCount;
     quint8 m_retrySynCount;
     quint8 m_retryInitCount;
     quint8 m_retryDataCount;
-    quint8 m_blockToSend;
+    quint32 m_blockToSend;
+    quint32 m_blocksHashed;
+    int m_sendFragSize;
+    QByteArray m_sendPayload;
+    TreeHash m_sendHash;
+    quint8 m_ackEvery;
+    quint8 m_ackBlock;
+    QByteArray m_pendingAck;
+    bool m_holdAck;
     bool m_server;
 
     quint32 m_fragsToReceive;
     quint32 m_fragsReceived;
     quint8 m_ackLimit;
     quint8 m_ackRecieved;
+    quint8 m_blockExpected;
+    TreeHash m_receiveHash;
+    QByteArray m_expectedHash;
     bool m_isFile;
     QFile *m_file;
     QString m_msg;
@@ -88,6 +157,56 @@ private:
     bool m_sendCurrupt;
     bool m_tempSendCurrupt;
 
+    struct SessionTicket {
+        QHostAddress address;
+        qint64 expires;
+        QByteArray key;
+    };
+    struct ResumeTicket {
+        quint32 ticket;
+        QByteArray key;
+    };
+    QHash<quint32, SessionTicket> m_issuedTickets;
+    QList<quint32> m_ticketExpiry;
+    QHash<QString, ResumeTicket> m_resumeTickets;
+    quint32 m_resumeTicket;
+    bool m_resumeAccepted;
+    QByteArray m_resumeKey;
+
+    Aead m_aead;
+    QByteArray m_sealed;
+    QByteArray m_opened;
+    Aead::Cipher m_cipher;
+    QByteArray m_psk;
+    QByteArray m_localPublic;
+
+    IoRing *m_io;
+    int m_fileSlot;
+    qint64 m_fileOffset;
+    bool m_fileFailed;
+    QHash<int, QString> m_readNames;
+
+    QFutureWatcher<FileData> *m_dirWatcher;
+    QString m_dirName;
+    QStringList m_dirPaths;
+    QVector<quint16> m_dirModes;
+
+    struct DirEntry {
+        QString path;
+        quint32 size;
+        quint16 mode;
+    };
+    bool m_isDirectory;
+    QString m_dirReceiveRoot;
+    QByteArray m_dirStream;
+    qint64 m_dirEntryCount;
+    QVector<DirEntry> m_dirEntries;
+    int m_dirFileIndex;
+    QSet<QString> m_dirCreated;
+    QHash<QFutureWatcher<WriteResult> *, QString> m_dirWrites;
+    int m_dirWritten;
+    bool m_dirComplete;
+
 signals:
     void receivedMessage(const QString &);
     void debugMessage(const QString &);
@@ -0,0 +1,313 @@
+#include "timerwheel.h"
+#include <QThreadStorage>
+#ifdef Q_OS_LINUX
+#include <QSocketNotifier>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#else
+#include <QTimer>
+#endif
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define NO_EXPIRY Q_UINT64_C(0xffffffffffffffff)
+
+static void initList(TimerLink *head)
+{
+    head->prev = head;
+    head->next = head;
+}
+
+static bool isEmpty(const TimerLink *head)
+{
+    return head->next == head;
+}
+
+// Moves the whole list from one head to another in O(1)
+static void splice(TimerLink *from, TimerLink *to)
+{
+    if (isEmpty(from)) {
+        initList(to);
+        return;
+    }
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    initList(from);
+}
+
+WheelTimer::WheelTimer()
+    : m_expires(0)
+    , m_interval(0)
+    , m_level(0)
+    , m_wheel(nullptr)
+{
+    prev = nullptr;
+    next = nullptr;
+}
+
+WheelTimer::~WheelTimer()
+{
+    stop();
+}
+
+void WheelTimer::setInterval(int msec)
+{
+    m_interval = msec;
+}
+
+int WheelTimer::interval() const
+{
+    return m_interval;
+}
+
+void WheelTimer::setCallback(const std::function<void()> &callback)
+{
+    m_callback = callback;
+}
+
+void WheelTimer::start()
+{
+    if (!m_wheel) {
+        m_wheel = TimerWheel::instance();
+    }
+    m_wheel->start(this);
+}
+
+void WheelTimer::stop()
+{
+    if (isActive()) {
+        m_wheel->stop(this);
+    }
+}
+
+bool WheelTimer::isActive() const
+{
+    return next != nullptr;
+}
+
+TimerWheel *TimerWheel::instance()
+{
+    static QThreadStorage<TimerWheel *> wheels;
+    if (!wheels.hasLocalData()) {
+        wheels.setLocalData(new TimerWheel);
+    }
+    return wheels.localData();
+}
+
+TimerWheel::TimerWheel(QObject *parent) : QObject(parent)
+  , m_base(0)
+  , m_armedFor(NO_EXPIRY)
+  , m_advancing(false)
+{
+    for (int level = 0; level < WHEEL_LEVELS; ++level) {
+        m_count[level] = 0;
+        for (int slot = 0; slot < WHEEL_SLOTS; ++slot) {
+            initList(&m_slots[level][slot]);
+        }
+    }
+    m_clock.start();
+
+#ifdef Q_OS_LINUX
+    m_timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    m_notifier = new QSocketNotifier(m_timerFd, QSocketNotifier::Read, this);
+    connect(m_notifier, SIGNAL(activated(int)), this, SLOT(on_tick()));
+#else
+    m_timer = new QTimer(this);
+    m_timer->setSingleShot(true);
+    m_timer->setTimerType(Qt::PreciseTimer);
+    connect(m_timer, SIGNAL(timeout()), this, SLOT(on_tick()));
+#endif
+}
+
+TimerWheel::~TimerWheel()
+{
+#ifdef Q_OS_LINUX
+    ::close(m_timerFd);
+#endif
+}
+
+int TimerWheel::activeCount() const
+{
+    int count = 0;
+    for (int level = 0; level < WHEEL_LEVELS; ++level) {
+        count += m_count[level];
+    }
+    return count;
+}
+
+quint64 TimerWheel::now() const
+{
+    return static_cast<quint64>(m_clock.elapsed());
+}
+
+void TimerWheel::start(WheelTimer *timer)
+{
+    if (timer->isActive()) {
+        unlink(timer);
+    }
+    const quint64 current = now();
+    // An idle wheel jumps to the present instead of walking the gap later
+    if (activeCount() == 0 && !m_advancing) {
+        m_base = qMax(m_base, current);
+    }
+    timer->m_expires = current + static_cast<quint64>(qMax(0, timer->m_interval));
+    add(timer);
+    // Restarting a deadline further out, as on every sent packet, costs no syscall
+    if (!m_advancing && timer->m_expires < m_armedFor) {
+        arm(timer->m_expires);
+    }
+}
+
+void TimerWheel::stop(WheelTimer *timer)
+{
+    // The armed wakeup stays, an early tick with nothing to do is cheaper than a syscall here
+    unlink(timer);
+}
+
+void TimerWheel::add(WheelTimer *timer)
+{
+    qint64 delta = static_cast<qint64>(timer->m_expires - m_base);
+    quint64 expires = timer->m_expires;
+    int level = 0;
+    if (delta < 0) {
+        expires = m_base;
+    } else {
+        while (level < WHEEL_LEVELS - 1 && delta >= (Q_INT64_C(1) << (WHEEL_BITS * (level + 1)))) {
+            ++level;
+        }
+        // Beyond the top level it parks in the last slot and gets re-sorted on cascade
+        const qint64 range = Q_INT64_C(1) << (WHEEL_BITS * WHEEL_LEVELS);
+        if (delta >= range) {
+            expires = m_base + static_cast<quint64>(range - 1);
+        }
+    }
+
+    TimerLink *head = &m_slots[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    timer->m_level = level;
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+    ++m_count[level];
+}
+
+void TimerWheel::unlink(WheelTimer *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = nullptr;
+    timer->next = nullptr;
+    --m_count[timer->m_level];
+}
+
+int TimerWheel::cascade(int level, int index)
+{
+    TimerLink list;
+    splice(&m_slots[level][index], &list);
+    while (!isEmpty(&list)) {
+        WheelTimer *timer = static_cast<WheelTimer *>(list.next);
+        unlink(timer);
+        add(timer);
+    }
+    return index;
+}
+
+void TimerWheel::advance(quint64 now)
+{
+    m_advancing = true;
+    while (m_base <= now) {
+        int index = static_cast<int>(m_base & WHEEL_MASK);
+
+        // Nothing left on the lowest level, skip ahead to the next cascade point
+        if (index != 0 && m_count[0] == 0) {
+            m_base = qMin((m_base | WHEEL_MASK) + 1, now + 1);
+            continue;
+        }
+
+        if (index == 0 && cascade(1, (m_base >> WHEEL_BITS) & WHEEL_MASK) == 0
+                && cascade(2, (m_base >> (2 * WHEEL_BITS)) & WHEEL_MASK) == 0) {
+            cascade(3, (m_base >> (3 * WHEEL_BITS)) & WHEEL_MASK);
+        }
+        ++m_base;
+
+        // Callbacks may stop or restart any timer, including ones still on this list
+        TimerLink expired;
+        splice(&m_slots[0][index], &expired);
+        while (!isEmpty(&expired)) {
+            WheelTimer *timer = static_cast<WheelTimer *>(expired.next);
+            unlink(timer);
+            if (timer->m_callback) {
+                timer->m_callback();
+            }
+        }
+    }
+    m_advancing = false;
+}
+
+quint64 TimerWheel::nextExpiry() const
+{
+    quint64 next = NO_EXPIRY;
+    if (m_count[0] > 0) {
+        for (quint64 i = 0; i < WHEEL_SLOTS; ++i) {
+            if (!isEmpty(&m_slots[0][(m_base + i) & WHEEL_MASK])) {
+                next = m_base + i;
+                break;
+            }
+        }
+    }
+    // Upper levels need a wakeup at the tick where their slot cascades down
+    for (int level = 1; level < WHEEL_LEVELS; ++level) {
+        if (m_count[level] == 0) {
+            continue;
+        }
+        const int shift = WHEEL_BITS * level;
+        // Sitting on a window boundary, that window's cascade hasn't run yet
+        const quint64 first = (m_base & ((Q_UINT64_C(1) << shift) - 1)) == 0 ? 0 : 1;
+        for (quint64 i = first; i < first + WHEEL_SLOTS; ++i) {
+            quint64 window = (m_base >> shift) + i;
+            if (!isEmpty(&m_slots[level][window & WHEEL_MASK])) {
+                next = qMin(next, window << shift);
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+void TimerWheel::arm(quint64 tick)
+{
+    m_armedFor = tick;
+    qint64 delay = tick == NO_EXPIRY ? -1 : qMax<qint64>(0, static_cast<qint64>(tick - now()));
+#ifdef Q_OS_LINUX
+    itimerspec spec = {};
+    if (delay >= 0) {
+        spec.it_value.tv_sec = static_cast<time_t>(delay / 1000);
+        // A zero it_value would disarm, so an overdue tick fires after 1 ns
+        spec.it_value.tv_nsec = delay == 0 ? 1 : static_cast<long>((delay % 1000) * 1000000);
+    }
+    timerfd_settime(m_timerFd, 0, &spec, nullptr);
+#else
+    if (delay < 0) {
+        m_timer->stop();
+    } else {
+        m_timer->start(static_cast<int>(delay));
+    }
+#endif
+}
+
+void TimerWheel::on_tick()
+{
+#ifdef Q_OS_LINUX
+    quint64 expirations;
+    if (::read(m_timerFd, &expirations, sizeof(expirations)) < 0) {
+        expirations = 0;
+    }
+#endif
+    m_armedFor = NO_EXPIRY;
+    advance(now());
+    quint64 next = nextExpiry();
+    if (next != NO_EXPIRY) {
+        arm(next);
+    }
+}
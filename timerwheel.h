@@ -0,0 +1,91 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <QObject>
+#include <QElapsedTimer>
+#include <functional>
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+class QSocketNotifier;
+class QTimer;
+class TimerWheel;
+
+struct TimerLink {
+    TimerLink *prev;
+    TimerLink *next;
+};
+
+// Single-shot deadline that lives inside its owner, start() and stop() are
+// O(1) and never allocate. Behaves like a single-shot QTimer.
+class WheelTimer : public TimerLink
+{
+public:
+    WheelTimer();
+    ~WheelTimer();
+    WheelTimer(const WheelTimer &) = delete;
+    WheelTimer &operator=(const WheelTimer &) = delete;
+
+    void setInterval(int msec);
+    int interval() const;
+    void setCallback(const std::function<void()> &callback);
+
+    void start();
+    void stop();
+    bool isActive() const;
+
+private:
+    friend class TimerWheel;
+    quint64 m_expires;
+    int m_interval;
+    int m_level;
+    std::function<void()> m_callback;
+    TimerWheel *m_wheel;
+};
+
+// Hierarchical timing wheel, 4 levels of 64 slots with 1 ms ticks. One wheel
+// per thread, driven by a single timerfd (a single QTimer off Linux) that is
+// only reprogrammed when a deadline earlier than the armed one shows up.
+class TimerWheel : public QObject
+{
+    Q_OBJECT
+public:
+    static TimerWheel *instance();
+    ~TimerWheel();
+
+    int activeCount() const;
+
+private slots:
+    void on_tick();
+
+private:
+    friend class WheelTimer;
+    explicit TimerWheel(QObject *parent = nullptr);
+
+    void start(WheelTimer *timer);
+    void stop(WheelTimer *timer);
+    void add(WheelTimer *timer);
+    void unlink(WheelTimer *timer);
+    void advance(quint64 now);
+    int cascade(int level, int index);
+    quint64 nextExpiry() const;
+    void arm(quint64 tick);
+    quint64 now() const;
+
+    TimerLink m_slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    int m_count[WHEEL_LEVELS];
+    quint64 m_base;
+    quint64 m_armedFor;
+    bool m_advancing;
+    QElapsedTimer m_clock;
+#ifdef Q_OS_LINUX
+    int m_timerFd;
+    QSocketNotifier *m_notifier;
+#else
+    QTimer *m_timer;
+#endif
+};
+
+#endif // TIMERWHEEL_H
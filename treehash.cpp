@@ -0,0 +1,140 @@
+#include "treehash.h"
+#include <QCryptographicHash>
+#include <QtConcurrent>
+#include <QtEndian>
+
+// Below this many whole chunks in one update the thread pool costs more than it saves.
+// Multicast hashes whole payloads and Socket whole ACK blocks, so it's reached by
+// any multicast file over 64 KiB and by unicast blocks of 64 KiB or more.
+#define TREEHASH_PARALLEL_CHUNKS 64
+
+namespace {
+
+struct LeafHasher {
+    typedef QByteArray result_type;
+
+    const char *data;
+    quint64 firstIndex;
+
+    QByteArray operator()(int i) const
+    {
+        return TreeHash::leaf(firstIndex + static_cast<quint64>(i), data + i * TREEHASH_CHUNK_SIZE, TREEHASH_CHUNK_SIZE);
+    }
+};
+
+}
+
+TreeHash::TreeHash()
+    : m_chunks(0)
+    , m_length(0)
+{
+}
+
+void TreeHash::reset()
+{
+    m_stack.clear();
+    m_pending.clear();
+    m_chunks = 0;
+    m_length = 0;
+}
+
+QByteArray TreeHash::leaf(quint64 index, const char *data, int len)
+{
+    char prefix[9];
+    prefix[0] = 0x00;
+    qToLittleEndian(index, prefix + 1);
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    hash.addData(prefix, sizeof(prefix));
+    hash.addData(data, len);
+    return hash.result();
+}
+
+QByteArray TreeHash::parent(const QByteArray &left, const QByteArray &right)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    hash.addData("\x01", 1);
+    hash.addData(left);
+    hash.addData(right);
+    return hash.result();
+}
+
+void TreeHash::pushChunk(QByteArray cv)
+{
+    // The stack keeps one finished subtree per set bit of the chunk count
+    quint64 total = ++m_chunks;
+    while ((total & 1) == 0) {
+        cv = parent(m_stack.takeLast(), cv);
+        total >>= 1;
+    }
+    m_stack.append(cv);
+}
+
+void TreeHash::addData(const char *data, int len)
+{
+    m_length += static_cast<quint64>(len);
+
+    if (!m_pending.isEmpty()) {
+        int take = qMin(len, TREEHASH_CHUNK_SIZE - m_pending.size());
+        m_pending.append(data, take);
+        data += take;
+        len -= take;
+        if (m_pending.size() < TREEHASH_CHUNK_SIZE) {
+            return;
+        }
+        pushChunk(leaf(m_chunks, m_pending.constData(), TREEHASH_CHUNK_SIZE));
+        m_pending.clear();
+    }
+
+    const int whole = len / TREEHASH_CHUNK_SIZE;
+    if (whole >= TREEHASH_PARALLEL_CHUNKS) {
+        QVector<int> indexes(whole);
+        for (int i = 0; i < whole; ++i) {
+            indexes[i] = i;
+        }
+        const QVector<QByteArray> leaves = QtConcurrent::blockingMapped<QVector<QByteArray>>(indexes, LeafHasher{data, m_chunks});
+        for (const QByteArray &cv: leaves) {
+            pushChunk(cv);
+        }
+    } else {
+        for (int i = 0; i < whole; ++i) {
+            pushChunk(leaf(m_chunks, data + i * TREEHASH_CHUNK_SIZE, TREEHASH_CHUNK_SIZE));
+        }
+    }
+
+    m_pending.append(data + whole * TREEHASH_CHUNK_SIZE, len - whole * TREEHASH_CHUNK_SIZE);
+}
+
+void TreeHash::addData(const QByteArray &data)
+{
+    addData(data.constData(), data.size());
+}
+
+QByteArray TreeHash::result() const
+{
+    // A trailing partial chunk, or the empty input, is the rightmost leaf
+    QVector<QByteArray> stack = m_stack;
+    QByteArray cv;
+    if (!m_pending.isEmpty() || m_chunks == 0) {
+        cv = leaf(m_chunks, m_pending.constData(), m_pending.size());
+    } else {
+        cv = stack.takeLast();
+    }
+    while (!stack.isEmpty()) {
+        cv = parent(stack.takeLast(), cv);
+    }
+
+    char length[8];
+    qToLittleEndian(m_length, length);
+    QCryptographicHash root(QCryptographicHash::Sha256);
+    root.addData("\x02", 1);
+    root.addData(cv);
+    root.addData(length, sizeof(length));
+    return root.result();
+}
+
+QByteArray TreeHash::hash(const QByteArray &data)
+{
+    TreeHash tree;
+    tree.addData(data);
+    return tree.result();
+}
@@ -0,0 +1,39 @@
+#ifndef TREEHASH_H
+#define TREEHASH_H
+
+#include <QByteArray>
+#include <QVector>
+
+#define TREEHASH_SIZE 32
+#define TREEHASH_CHUNK_SIZE 1024
+
+// BLAKE3-style tree hash over SHA-256. Data is cut into 1 KiB chunks, each
+// leaf is hashed with its chunk index so leaves are independent of each
+// other and can be hashed in parallel or out of order. Parents join two
+// subtrees, the root also binds the total length.
+// leaf = H(0x00 | index 8 | chunk), parent = H(0x01 | left | right),
+// root = H(0x02 | top | length 8)
+class TreeHash
+{
+public:
+    TreeHash();
+
+    void reset();
+    void addData(const char *data, int len);
+    void addData(const QByteArray &data);
+    QByteArray result() const;
+
+    static QByteArray hash(const QByteArray &data);
+    static QByteArray leaf(quint64 index, const char *data, int len);
+    static QByteArray parent(const QByteArray &left, const QByteArray &right);
+
+private:
+    void pushChunk(QByteArray cv);
+
+    QVector<QByteArray> m_stack;
+    QByteArray m_pending;
+    quint64 m_chunks;
+    quint64 m_length;
+};
+
+#endif // TREEHASH_H